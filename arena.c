@@ -0,0 +1,92 @@
+// File:  arena.c
+// List all group member's name: Sunny Chen, Michael Zhao
+
+#include <string.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+
+/* Smallest size class that fits size bytes */
+static int size_class(size_t size) {
+	int c = 0;
+	while ((size_t)(16 << c) < size) {
+		c++;
+	}
+	return c;
+}
+
+/* 
+ * The arena struct lives at the start of its first bump region. Like every
+ * other arena memory it comes from mmap, so a thread can get its arena
+ * while the scheduler's signal handler frees into it.
+ */
+arena_t* new_arena() {
+	char *chunk = mmap(NULL, ARENA_CHUNK, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chunk == MAP_FAILED)
+		return NULL;
+
+	arena_t *arena = (arena_t *)chunk;  // mapping is zero filled
+	arena->bump = chunk + ((sizeof(*arena) + 15) & ~(size_t)15);
+	arena->bump_end = chunk + ARENA_CHUNK;
+	return arena;
+}
+
+/* 
+ * Allocate size bytes from arena. Caller must keep the thread from being
+ * preempted, arenas have no locking of their own.
+ */
+void* arena_alloc(arena_t *arena, size_t size) {
+	arena_block_t *block;
+
+	if (size > ARENA_MAX_SMALL) {
+		/* mmap, not malloc, so it can be freed from the scheduler's handler */
+		block = mmap(NULL, sizeof(*block) + size, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (block == MAP_FAILED)
+			return NULL;
+		block->size_class = ARENA_LARGE;
+		block->size = size;
+		return block + 1;
+	}
+
+	int c = size_class(size);
+	arena_free_t *free_block = arena->free_lists[c];
+	if (free_block != NULL) {  // reuse freed block of this class
+		arena->free_lists[c] = free_block->next;
+		return free_block;
+	}
+
+	size_t need = sizeof(*block) + (16 << c);
+	if (arena->bump == NULL || (size_t)(arena->bump_end - arena->bump) < need) {
+		/* rest of the old region is abandoned, it is at most one block */
+		char *chunk = mmap(NULL, ARENA_CHUNK, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk == MAP_FAILED)
+			return NULL;
+		arena->bump = chunk;
+		arena->bump_end = chunk + ARENA_CHUNK;
+	}
+
+	block = (arena_block_t *)arena->bump;
+	arena->bump += need;
+	block->size_class = c;
+	block->size = size;
+	return block + 1;
+}
+
+/* Return a block to arena's free lists, it can come from any arena */
+void arena_free(arena_t *arena, void *ptr) {
+	if (ptr == NULL)
+		return;
+
+	arena_block_t *block = (arena_block_t *)ptr - 1;
+	if (block->size_class == ARENA_LARGE) {
+		munmap(block, sizeof(*block) + block->size);
+		return;
+	}
+
+	arena_free_t *free_block = ptr;
+	free_block->next = arena->free_lists[block->size_class];
+	arena->free_lists[block->size_class] = free_block;
+}
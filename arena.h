@@ -0,0 +1,47 @@
+// File:  arena.h
+// List all group member's name: Sunny Chen, Michael Zhao
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_CLASSES 8            /* size classes 16, 32, ..., 2048 bytes */
+#define ARENA_MAX_SMALL (16 << (ARENA_CLASSES-1))
+#define ARENA_CHUNK (64 * 1024)    /* bump region mapped at a time */
+#define ARENA_LARGE 0xff           /* size_class of blocks from mmap() */
+
+/* header in front of every block, keeps payloads 16 byte aligned */
+typedef struct arena_block_t {
+	uint32_t size_class;
+	uint32_t pad;
+	size_t   size;        /* requested size, only used for large blocks */
+} arena_block_t;
+
+
+/* free block, stored in the payload while the block is unused */
+typedef struct arena_free_t {
+	struct arena_free_t *next;
+} arena_free_t;
+
+
+/* 
+ * Per-thread allocator. Small sizes come from per-class free lists and
+ * then a bump region, so the fast path is a few pointer moves with no
+ * locking. Arenas are never freed, an exiting thread's arena is handed
+ * to the next thread that needs one.
+ */
+typedef struct arena_t {
+	arena_free_t*   free_lists[ARENA_CLASSES];
+	char*           bump;
+	char*           bump_end;
+	struct arena_t* next;  /* link in the spare arena list */
+} arena_t;
+
+
+arena_t* new_arena();
+void*    arena_alloc(arena_t *arena, size_t size);
+void     arena_free(arena_t *arena, void *ptr);
+
+#endif
@@ -6,70 +6,72 @@
 
 #include <pthread.h>
 #include "../rpthread.h"
+#include "record.h"
 
 #define DEFAULT_THREAD_NUM 2
-#define RAM_SIZE 160
 #define RECORD_NUM 10
-#define RECORD_SIZE 4194304
 
 /* Global variables */
 pthread_mutex_t   mutex;
 int thread_num;
 int* counter;
 pthread_t *thread;
-int *mem = NULL;
+record_file_t records[RECORD_NUM];
 int sum = 0;
-int itr = RECORD_SIZE / 16;
 
+/* 
+ * Sum this thread's slice of every record. Records are mapped once by main,
+ * so each thread reads its slice in place and only takes the mutex once to
+ * merge its local sum.
+ */
 void external_calculate(void* arg) {
 	
-	int i = 0, j = 0, k = 0;
+	int k = 0;
+	size_t i = 0, count = 0;
 	int n = *((int*) arg);
+	int local = 0;
+	const int32_t *slice;
 
-	for (k = n; k < RECORD_NUM; k += thread_num) {
+	for (k = 0; k < RECORD_NUM; ++k) {
+		record_slice(&records[k], n, thread_num, &slice, &count);
+		for (i = 0; i < count; ++i) {
+			local += slice[i];
+		}
+	}
 
-		char a[3];
-		char path[20] = "./record/";
+	pthread_mutex_lock(&mutex);
+	sum += local;
+	pthread_mutex_unlock(&mutex);
 
-		sprintf(a, "%d", k);
-		strcat(path, a);
+	pthread_exit(NULL);
+}
 
-		FILE *f;
-		f = fopen(path, "r");
-		if (!f) {
-			printf("failed to open file %s, please run ./genRecord.sh first\n", path);
-			exit(0);
-		}
 
-		for (i = 0; i < itr; ++i) {
-			// read 16B from nth record into memory from mem[n*4]
-			for (j = 0; j < 4; ++j) {
-				fscanf(f, "%d", &mem[k*4 + j]);
-				pthread_mutex_lock(&mutex);
-				sum += mem[k*4 + j];
-				pthread_mutex_unlock(&mutex);
-			}
-		}
-		fclose(f);
-	}
+/* Map ./record/k.bin, falling back to the text record ./record/k */
+void open_record(int k) {
+	char path[32];
 
-	pthread_exit(NULL);
+	sprintf(path, "./record/%d.bin", k);
+	if (record_open(path, &records[k]) == 0)
+		return;
+
+	sprintf(path, "./record/%d", k);
+	if (record_open(path, &records[k]) != 0) {
+		printf("failed to open file %s, please run ./genRecord.sh first\n", path);
+		exit(0);
+	}
 }
 
 
 void verify() {
 	
-	int i = 0, j = 0, k = 0;
-	char a[3];
-	char path[20] = "./record/";
+	int k = 0, v = 0;
+	char path[32];
 
 	sum = 0;
-	memset(mem, 0, RAM_SIZE);
 
-	for (k = 0; k < 10; ++k) {
-		strcpy(path, "./record/");
-		sprintf(a, "%d", k);
-		strcat(path, a);
+	for (k = 0; k < RECORD_NUM; ++k) {
+		sprintf(path, "./record/%d", k);
 
 		FILE *f;
 		f = fopen(path, "r");
@@ -78,12 +80,8 @@ void verify() {
 			exit(0);
 		}
 
-		for (i = 0; i < itr; ++i) {
-			// read 16B from nth record into memory from mem[n*4]
-			for (j = 0; j < 4; ++j) {
-				fscanf(f, "%d\n", &mem[k*4 + j]);
-				sum += mem[k*4 + j];
-			}
+		while (fscanf(f, "%d\n", &v) == 1) {
+			sum += v;
 		}
 		fclose(f);
 	}
@@ -118,13 +116,14 @@ int main(int argc, char **argv) {
 
 	// initialize pthread_t
 	thread = (pthread_t*)malloc(thread_num*sizeof(pthread_t));
-	mem = (int*)malloc(RAM_SIZE);
-	memset(mem, 0, RAM_SIZE);
 
 	pthread_mutex_init(&mutex, NULL);
 
 	struct timespec start, end;
         clock_gettime(CLOCK_REALTIME, &start);
+
+	for (i = 0; i < RECORD_NUM; ++i)
+		open_record(i);
  
 	for (i = 0; i < thread_num; ++i)
 		pthread_create(&thread[i], NULL, &external_calculate, &counter[i]);
@@ -147,7 +146,8 @@ int main(int argc, char **argv) {
 	// feel free to verify your answer here:
 	verify();
 	
-	free(mem);
+	for (i = 0; i < RECORD_NUM; ++i)
+		record_close(&records[i]);
 	free(thread);
 	free(counter);
 
@@ -14,3 +14,12 @@ while [ $ITER -lt 10 ]; do
 	done
 	let "ITER+=1"
 done
+
+# packed binary copies for external_cal, see record.h
+if [ -x ./record_convert ]; then
+	let "ITER=0"
+	while [ $ITER -lt 10 ]; do
+		./record_convert ./record/$ITER ./record/$ITER.bin
+		let "ITER+=1"
+	done
+fi
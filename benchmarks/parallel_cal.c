@@ -15,6 +15,10 @@ int* a[R_SIZE];
 int  pSum[R_SIZE];
 int  sum = 0;
 
+#ifdef USE_RTHREAD
+rpthread_reducer_t reducer;  // per-thread partial sums, no lock per row
+#endif
+
 
 /* A CPU-bound task to do parallel array addition */
 void parallel_calculate(void* arg) {
@@ -28,9 +32,13 @@ void parallel_calculate(void* arg) {
 		}
 	}
 	for (j = n; j < R_SIZE; j += thread_num) {
+#ifdef USE_RTHREAD
+		rpthread_reducer_add(&reducer, pSum[j]);
+#else
 		pthread_mutex_lock(&mutex);
 		sum += pSum[j];
 		pthread_mutex_unlock(&mutex);
+#endif
 	}
 
 	pthread_exit(NULL);
@@ -88,6 +96,9 @@ int main(int argc, char **argv) {
 	memset(&pSum, 0, R_SIZE*sizeof(int));
 	// mutex init
 	pthread_mutex_init(&mutex, NULL);
+#ifdef USE_RTHREAD
+	rpthread_reducer_init(&reducer, RPTHREAD_REDUCE_SUM);
+#endif
 
 	struct timespec start, end;
         clock_gettime(CLOCK_REALTIME, &start);
@@ -97,6 +108,11 @@ int main(int argc, char **argv) {
 	for (i = 0; i < thread_num; ++i)
 		pthread_join(thread[i], NULL);
 
+#ifdef USE_RTHREAD
+	sum = (int)rpthread_reducer_get(&reducer);
+	rpthread_reducer_destroy(&reducer);
+#endif
+
 	clock_gettime(CLOCK_REALTIME, &end);
         printf("running time: %lu micro-seconds\n", 
 	       (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
@@ -0,0 +1,131 @@
+// File:  record.c
+// List all group member's name: Sunny Chen, Michael Zhao
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "record.h"
+
+
+/* Parse decimal text records into a heap array, returns number of values */
+static size_t parse_text(const char *text, size_t size, int32_t **out) {
+	size_t cap = 4096, count = 0;
+	int32_t *values = malloc(cap * sizeof(*values));
+
+	const char *p = text, *end = text + size;
+	while (p < end) {
+		while (p < end && (*p < '0' || *p > '9') && *p != '-')  // skip whitespace
+			p++;
+		if (p == end)
+			break;
+
+		int neg = (*p == '-');
+		if (neg)
+			p++;
+
+		int32_t v = 0;
+		while (p < end && *p >= '0' && *p <= '9') {
+			v = v * 10 + (*p - '0');
+			p++;
+		}
+
+		if (count == cap) {
+			cap *= 2;
+			values = realloc(values, cap * sizeof(*values));
+		}
+		values[count++] = neg ? -v : v;
+	}
+
+	*out = values;
+	return count;
+}
+
+
+/* 
+ * Map a record file. Binary files are used in place with no copying, text
+ * files are parsed once from the mapping into rec->parsed. Returns -1 if 
+ * the file can't be opened.
+ */
+int record_open(const char *path, record_file_t *rec) {
+	memset(rec, 0, sizeof(*rec));
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	rec->map_size = st.st_size;
+	rec->map = mmap(NULL, rec->map_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (rec->map == MAP_FAILED) {
+		rec->map = NULL;
+		return -1;
+	}
+
+	const record_header_t *header = rec->map;
+	if (rec->map_size >= sizeof(*header) && header->magic == RECORD_MAGIC) {
+		/* a truncated file must not send readers past the mapping */
+		if (header->count > (rec->map_size - sizeof(*header)) / sizeof(int32_t)) {
+			record_close(rec);
+			return -1;
+		}
+		rec->data = (const int32_t *)(header + 1);
+		rec->count = header->count;
+	}
+	else {  // text record from genRecord.sh
+		rec->count = parse_text(rec->map, rec->map_size, &rec->parsed);
+		rec->data = rec->parsed;
+		munmap(rec->map, rec->map_size);
+		rec->map = NULL;
+	}
+	return 0;
+}
+
+
+/* Split records into `parts` contiguous slices and return slice `part` */
+void record_slice(const record_file_t *rec, int part, int parts,
+				  const int32_t **begin, size_t *count) {
+	size_t start = rec->count * part / parts;
+	size_t end = rec->count * (part + 1) / parts;
+	*begin = rec->data + start;
+	*count = end - start;
+}
+
+
+void record_close(record_file_t *rec) {
+	if (rec->map != NULL)
+		munmap(rec->map, rec->map_size);
+	free(rec->parsed);
+	memset(rec, 0, sizeof(*rec));
+}
+
+
+/* Write a text record file out in the binary format */
+int record_convert(const char *text_path, const char *bin_path) {
+	record_file_t rec;
+	if (record_open(text_path, &rec) != 0)
+		return -1;
+
+	FILE *f = fopen(bin_path, "wb");
+	if (!f) {
+		record_close(&rec);
+		return -1;
+	}
+
+	record_header_t header = { RECORD_MAGIC, (uint32_t)rec.count };
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(rec.data, sizeof(*rec.data), rec.count, f);
+	fclose(f);
+
+	record_close(&rec);
+	return 0;
+}
@@ -0,0 +1,39 @@
+// File:  record.h
+// List all group member's name: Sunny Chen, Michael Zhao
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 
+ * Packed binary record file: a record_header_t followed by `count` native
+ * int32_t values. genRecord.sh writes decimal text records, record_convert
+ * turns them into this format.
+ */
+#define RECORD_MAGIC 0x43525052  /* "RPRC" */
+
+typedef struct record_header_t {
+	uint32_t magic;
+	uint32_t count;
+} record_header_t;
+
+
+/* an opened record file, data points into the mapping for binary files */
+typedef struct record_file_t {
+	void*          map;
+	size_t         map_size;
+	const int32_t* data;
+	size_t         count;
+	int32_t*       parsed;  /* heap copy for text files, NULL for binary */
+} record_file_t;
+
+
+int  record_open(const char *path, record_file_t *rec);
+void record_slice(const record_file_t *rec, int part, int parts,
+                  const int32_t **begin, size_t *count);
+void record_close(record_file_t *rec);
+int  record_convert(const char *text_path, const char *bin_path);
+
+#endif
@@ -0,0 +1,16 @@
+#include <stdio.h>
+#include "record.h"
+
+/* Convert text records from genRecord.sh to the packed binary format */
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		printf("usage: %s <text record> <binary record>\n", argv[0]);
+		return 1;
+	}
+
+	if (record_convert(argv[1], argv[2]) != 0) {
+		printf("failed to convert %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
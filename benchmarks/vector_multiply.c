@@ -15,15 +15,23 @@ int r[VECTOR_SIZE];
 int s[VECTOR_SIZE];
 int res = 0;
 
+#ifdef USE_RTHREAD
+rpthread_reducer_t reducer;  // per-thread partial sums, no lock per element
+#endif
+
 /* A CPU-bound task to do vector multiplication */
 void vector_multiply(void* arg) {
 	int i = 0;
 	int n = *((int*) arg);
 	
 	for (i = n; i < VECTOR_SIZE; i += thread_num) {
+#ifdef USE_RTHREAD
+		rpthread_reducer_add(&reducer, r[i] * s[i]);
+#else
 		pthread_mutex_lock(&mutex);
 		res += r[i] * s[i];
 		pthread_mutex_unlock(&mutex);	
+#endif
 	}
 
 	pthread_exit(NULL);
@@ -68,6 +76,9 @@ int main(int argc, char **argv) {
 	}
 
 	pthread_mutex_init(&mutex, NULL);
+#ifdef USE_RTHREAD
+	rpthread_reducer_init(&reducer, RPTHREAD_REDUCE_SUM);
+#endif
 
 	struct timespec start, end;
         clock_gettime(CLOCK_REALTIME, &start);
@@ -81,6 +92,11 @@ int main(int argc, char **argv) {
 	for (i = 0; i < thread_num; ++i)
 		pthread_join(thread[i], NULL);
 
+#ifdef USE_RTHREAD
+	res = (int)rpthread_reducer_get(&reducer);
+	rpthread_reducer_destroy(&reducer);
+#endif
+
 	clock_gettime(CLOCK_REALTIME, &end);
         printf("running time: %lu micro-seconds\n", 
 	       (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
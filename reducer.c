@@ -0,0 +1,116 @@
+// File:  reducer.c
+// List all group member's name: Sunny Chen, Michael Zhao
+
+#include <errno.h>
+#include <limits.h>
+#include "rpthread.h"
+
+
+static long reduce_sum(long a, long b) { return a + b; }
+static long reduce_min(long a, long b) { return (b < a) ? b : a; }
+static long reduce_max(long a, long b) { return (b > a) ? b : a; }
+
+static void fold_slot(void *arg);
+
+
+/* Initialize reducer for one of the built in ops */
+int rpthread_reducer_init(rpthread_reducer_t *reducer, rpthread_reduce_op_t kind) {
+	switch (kind) {
+	case RPTHREAD_REDUCE_SUM:
+		rpthread_reducer_init_custom(reducer, reduce_sum, 0);
+		break;
+	case RPTHREAD_REDUCE_MIN:
+		rpthread_reducer_init_custom(reducer, reduce_min, LONG_MAX);
+		break;
+	case RPTHREAD_REDUCE_MAX:
+		rpthread_reducer_init_custom(reducer, reduce_max, LONG_MIN);
+		break;
+	default:
+		return EINVAL;
+	}
+	reducer->kind = kind;
+	return 0;
+}
+
+/* Initialize reducer for an associative op with identity element identity */
+int rpthread_reducer_init_custom(rpthread_reducer_t *reducer, long (*op)(long, long), long identity) {
+	if (rpthread_key_create(&reducer->key, fold_slot) != 0)
+		return EAGAIN;  // out of TLS keys
+
+	reducer->kind = RPTHREAD_REDUCE_CUSTOM;
+	reducer->op = op;
+	reducer->identity = identity;
+	reducer->value = identity;
+	reducer->slots = NULL;
+	return 0;
+}
+
+/* Current result: finished threads' total combined with every live slot */
+long rpthread_reducer_get(rpthread_reducer_t *reducer) {
+	rpthread_preempt_disable();
+
+	long value = reducer->value;
+	for (reducer_slot_t *slot = reducer->slots; slot != NULL; slot = slot->next) {
+		value = reducer->op(value, slot->value);
+	}
+
+	rpthread_preempt_enable();
+	return value;
+}
+
+/* Free every slot and the TLS key */
+int rpthread_reducer_destroy(rpthread_reducer_t *reducer) {
+	rpthread_preempt_disable();
+
+	reducer_slot_t *slot = reducer->slots;
+	while (slot != NULL) {
+		reducer_slot_t *next = slot->next;
+		rpthread_free(slot->mem);
+		slot = next;
+	}
+	reducer->slots = NULL;
+	rpthread_key_delete(reducer->key);
+
+	rpthread_preempt_enable();
+	return 0;
+}
+
+/* First rpthread_reducer_add() on this thread, make and register its slot */
+reducer_slot_t* reducer_new_slot(rpthread_reducer_t *reducer) {
+	void *mem = rpthread_malloc(sizeof(reducer_slot_t) + CACHE_LINE - 1);
+	reducer_slot_t *slot = (reducer_slot_t *)(((uintptr_t)mem + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1));
+
+	slot->value = reducer->identity;
+	slot->reducer = reducer;
+	slot->mem = mem;
+	slot->prev = NULL;
+
+	rpthread_preempt_disable();
+	slot->next = reducer->slots;
+	if (reducer->slots != NULL)
+		reducer->slots->prev = slot;
+	reducer->slots = slot;
+	rpthread_preempt_enable();
+
+	rpthread_setspecific(reducer->key, slot);
+	return slot;
+}
+
+/* TLS destructor, folds an exiting thread's slot into the reducer */
+static void fold_slot(void *arg) {
+	reducer_slot_t *slot = arg;
+	rpthread_reducer_t *reducer = slot->reducer;
+
+	rpthread_preempt_disable();
+	reducer->value = reducer->op(reducer->value, slot->value);
+
+	if (slot->prev != NULL)
+		slot->prev->next = slot->next;
+	else
+		reducer->slots = slot->next;
+	if (slot->next != NULL)
+		slot->next->prev = slot->prev;
+	rpthread_preempt_enable();
+
+	rpthread_free(slot->mem);
+}
@@ -0,0 +1,65 @@
+// File:  reducer.h
+// List all group member's name: Sunny Chen, Michael Zhao
+
+#ifndef REDUCER_H
+#define REDUCER_H
+
+#include <stdint.h>
+#include "tcb.h"
+
+#define CACHE_LINE 64
+
+typedef enum rpthread_reduce_op_t {
+	RPTHREAD_REDUCE_SUM,
+	RPTHREAD_REDUCE_MIN,
+	RPTHREAD_REDUCE_MAX,
+	RPTHREAD_REDUCE_CUSTOM
+} rpthread_reduce_op_t;
+
+
+/* one thread's partial result, padded to its own cache line */
+typedef struct reducer_slot_t {
+	long                       value;
+	struct rpthread_reducer_t* reducer;
+	struct reducer_slot_t*     prev;  /* live slots of reducer */
+	struct reducer_slot_t*     next;
+	void*                      mem;   /* unaligned allocation to free */
+} __attribute__((aligned(CACHE_LINE))) reducer_slot_t;
+
+
+/* 
+ * Associative accumulator. Each thread combines into its own slot found
+ * through a TLS key, so updates take no lock. Slots are folded into value 
+ * when their thread exits, rpthread_reducer_get() folds the live ones too.
+ */
+typedef struct rpthread_reducer_t {
+	rpthread_key_t         key;       /* TLS key of the per-thread slot */
+	rpthread_reduce_op_t   kind;
+	long                 (*op)(long, long);
+	long                   identity;
+	long                   value;     /* slots of finished threads */
+	reducer_slot_t*        slots;     /* slots of live threads */
+} rpthread_reducer_t;
+
+
+int  rpthread_reducer_init(rpthread_reducer_t *reducer, rpthread_reduce_op_t kind);
+int  rpthread_reducer_init_custom(rpthread_reducer_t *reducer, long (*op)(long, long), long identity);
+long rpthread_reducer_get(rpthread_reducer_t *reducer);
+int  rpthread_reducer_destroy(rpthread_reducer_t *reducer);
+reducer_slot_t* reducer_new_slot(rpthread_reducer_t *reducer);
+
+void* rpthread_getspecific(rpthread_key_t key);
+
+/* Combine x into the calling thread's slot, inlined since it runs per element */
+static inline void rpthread_reducer_add(rpthread_reducer_t *reducer, long x) {
+	reducer_slot_t *slot = rpthread_getspecific(reducer->key);
+	if (slot == NULL)
+		slot = reducer_new_slot(reducer);
+
+	if (reducer->kind == RPTHREAD_REDUCE_SUM)
+		slot->value += x;
+	else
+		slot->value = reducer->op(slot->value, x);
+}
+
+#endif
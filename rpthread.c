@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include "rpthread.h"
 
 
@@ -16,8 +18,61 @@ static void schedule();
 
 void handle_timeout(int signum);
 void handle_exit();
+static void run_key_destructors(tcb_t *tcb);
+static void reserve_tcbs(uint32_t count);
+static size_t attr_stack_size(pthread_attr_t *attr);
+static void record_stack_usage(tcb_t *tcb);
+static void report_stack_usage();
+static void ready_thread(tcb_t *tcb);
+static void ready_next(tcb_t *tcb);
+static bool sched_run_next(int left);
+static bool outranked(tcb_t *tcb);
+static queue_t* ready_queue(tcb_t *tcb);
+static bool sched_yield_to(tcb_t *target, int left);
+static void block_on(queue_t *queue);
+static rpthread_future_t* new_future(void *(*function)(void *), void *arg);
+static void spawn_future(rpthread_future_t *future);
+static void* future_body(void *arg);
+static void future_resolve(rpthread_future_t *future, void *value);
+static void* pool_worker(void *arg);
+static void spawn_worker(rpthread_pool_t *pool);
+static arena_t* current_arena();
+static void charge_group(tcb_t *tcb, double ms_used);
+static bool over_share(tcb_t *tcb);
+static tcb_t* first_under_share(queue_t *queue);
+static bool parse_levels(const char *str, int *out);
+static void init_sched_config();
+static void report_sched_stats();
+static int sched_level(tcb_t *tcb);
+static int run_rank(tcb_t *tcb);
+static void set_run_priority(tcb_t *tcb, int priority);
+static void pi_update(tcb_t *tcb);
+static void pi_lend(tcb_t *holder, rpthread_mutex_t *mutex);
+static bool pi_unlink(tcb_t *tcb, rpthread_mutex_t *mutex);
+static bool sched_rt();
+static bool sched_edf();
+static void sched_rr();
+static void sched_mlfq();
+static void sched_next();
+static void requeue(tcb_t *tcb);
+static bool unqueue(tcb_t *tcb);
+static void start_job(tcb_t *tcb, double release);
+static void end_job(tcb_t *tcb);
+static void release_sleepers();
+static edf_t* edf_of(tcb_t *tcb);
+static int run_timeslice(tcb_t *tcb);
+static void boost_all();
+static void preempt();
+static double now_ms();
+static double sched_clock();
+static void vt_advance();
+static tcb_t* take_next(queue_t *queue);
+static rpthread_mutex_prof_t* new_mutex_prof(const char *file, int line);
+static int cmp_mutex_wait(const void *a, const void *b);
 void enable_timer();
 void disable_timer();
+static void resume_timer();
+static void create_done();
 
 
 /********** Static Variable Definitions **********/
@@ -25,6 +80,12 @@ void disable_timer();
 static Scheduler *scheduler;
 static struct itimerval itimer;
 static struct sigaction sa;
+static arena_t boot_arena;
+
+/* mutex profiling, enabled by RPTHREAD_MUTEX_PROFILE=1. Mutexes can be
+ * initialized before the scheduler so this lives outside of it. */
+static int mutex_profile = -1;  // -1 = environment not read yet
+static rpthread_mutex_prof_t *mutex_profs;
 
 
 /********** Rpthread Public Functions **********/
@@ -36,13 +97,17 @@ static struct sigaction sa;
  * Initializes exit_context for threads that finish. 
  */
 void init_scheduler() {
-	scheduler = malloc(sizeof(*scheduler));
+	scheduler = calloc(1, sizeof(*scheduler));
 
 	// setup mlfq queues
 	// if sched==RR, only first queue will be used
 	for (int i=0; i < MLFQ_LEVELS; i++) {
 		scheduler->thread_queues[i] = new_queue();
 	}
+	for (int i=0; i < RPTHREAD_RT_LEVELS; i++) {
+		scheduler->rt_queues[i] = new_queue();
+	}
+	scheduler->edf_heap = new_heap();
 
 	// setup tcb_arr to hold tcb refs
 	scheduler->t_count = 1;  // 1 for main thread
@@ -64,6 +129,16 @@ void init_scheduler() {
 	scheduler->exit_uctx->uc_link = NULL;
 	makecontext(scheduler->exit_uctx, handle_exit, 0);
 
+	// optional stack painting to measure stack high-water marks
+	char *paint = getenv("RPTHREAD_STACK_PAINT");
+	scheduler->stack_paint = (paint != NULL && strcmp(paint, "0") != 0);
+	if (scheduler->stack_paint)
+		atexit(report_stack_usage);
+
+	// MLFQ tuning from the environment, see rpthread_sched_config_t
+	init_sched_config();
+	main_tcb->timeslice = scheduler->allotment[0];
+
 	// initialize timer signals
 	memset (&sa, 0, sizeof (sa));
 	sa.sa_handler = &handle_timeout;
@@ -72,13 +147,15 @@ void init_scheduler() {
 
 
 /* 
- * Creates and adds thread to scheduler queue. No support for
- * pthread_attr_t, just there to match signiture of pthread_create.
- * This function may take a while to run, so we disable_timer()
+ * Creates and adds thread to scheduler queue. Only the stack size of
+ * pthread_attr_t is used (pthread_attr_setstacksize()), attr=NULL gives
+ * SS_SIZE. This function may take a while to run, so we disable_timer()
  * to make it thread safe.
  */
 int rpthread_create(rpthread_t *thread, pthread_attr_t *attr,
 					void *(*function)(void *), void *arg) {
+	rpthread_preempt_point();
+
 	if (scheduler == NULL) {  // first time running
 		init_scheduler();
 	}
@@ -86,31 +163,114 @@ int rpthread_create(rpthread_t *thread, pthread_attr_t *attr,
 		disable_timer();
 	}
 
+	tcb_t *tcb = new_tcb(scheduler->t_count, function, arg);
+	if (setup_tcb_context(tcb->uctx, scheduler->exit_uctx, tcb,
+						  attr_stack_size(attr), scheduler->stack_paint) != 0) {
+		rpthread_free(tcb->joined);
+		rpthread_free(tcb->uctx);
+		rpthread_free(tcb);
+		create_done();
+		return EAGAIN;  // couldn't map stack
+	}
+
 	*thread = scheduler->t_count;
 	scheduler->t_count++;
+	tcb->timeslice = scheduler->allotment[0];
 
-	tcb_t *tcb = new_tcb(*thread, function, arg);
-	setup_tcb_context(tcb->uctx, scheduler->exit_uctx, tcb);
-
-	// resize ts_arr if too many threads
-	if (scheduler->t_count > scheduler->t_max) {
-		scheduler->t_max += 32;
-		scheduler->tcb_arr = realloc(scheduler->tcb_arr, scheduler->t_max * sizeof(*(scheduler->tcb_arr)));
-	}
+	reserve_tcbs(scheduler->t_count);  // resize tcb_arr if too many threads
 	scheduler->tcb_arr[*thread] = tcb;
 
 	enqueue(scheduler->thread_queues[0], tcb);  // new thread starts at top queue 
-	enable_timer(TIMESLICE);
+	create_done();
     return 0;
 };
 
 
+/* 
+ * Create n threads running function at once. Thread i gets args + i*stride
+ * as its argument (stride 0 passes args to all of them) and its id is 
+ * stored in threads[i]. tcb_arr is grown once, tcbs, contexts and stacks 
+ * come from one allocation each, and the timer is only stopped once, so
+ * this is much cheaper than n calls to rpthread_create().
+ */
+int rpthread_create_n(rpthread_t *threads, int n, pthread_attr_t *attr,
+					  void *(*function)(void *), void *args, size_t stride) {
+	rpthread_preempt_point();
+
+	if (n <= 0)
+		return 0;
+
+	if (scheduler == NULL) {  // first time running
+		init_scheduler();
+	}
+	else {
+		disable_timer();
+	}
+
+	rpthread_t first = scheduler->t_count;
+	tcb_batch_t *batch = new_tcb_batch(first, n, function, args, stride, scheduler->exit_uctx,
+									   attr_stack_size(attr), scheduler->stack_paint);
+	if (batch == NULL) {
+		create_done();
+		return EAGAIN;  // couldn't map stacks
+	}
+
+	scheduler->t_count += n;
+	reserve_tcbs(scheduler->t_count);
+
+	queue_t *queue = scheduler->thread_queues[0];  // new threads start at top queue
+	for (int i=0; i < n; i++) {
+		tcb_t *tcb = &batch->tcbs[i];
+		tcb->timeslice = scheduler->allotment[0];
+		scheduler->tcb_arr[first + i] = tcb;
+		threads[i] = tcb->tid;
+		enqueue(queue, tcb);
+	}
+
+	create_done();
+	return 0;
+};
+
+
 /* 
  * No need to do anything. The scheduler assumes that whenever it is called,
  * the previously running thread wants to stop running, so it will automatically
  * put it back into queue.
  */
 int rpthread_yield() {
+	vt_advance();
+	schedule();
+	return 0;
+};
+
+
+/* 
+ * Instrumented point where a thread can be preempted in virtual time mode.
+ * Advances the virtual clock by one tick and switches threads once the
+ * running one used up its timeslice. Mutexes, rwlocks, create, join, group
+ * join, future waits and pool submits call it too, CPU-bound loops that use
+ * none of them should call it themselves. Does nothing with the real timer.
+ */
+void rpthread_preempt_point() {
+	if (scheduler == NULL || !scheduler->virtual_time)
+		return;
+
+	vt_advance();
+	if (scheduler->vclock - scheduler->running->last_run >= scheduler->armed_ms)
+		handle_timeout(SIGPROF);
+};
+
+
+/* 
+ * Yield straight to thread if it is ready, giving it the rest of the
+ * caller's timeslice, instead of letting every other ready thread run first.
+ * Falls back to a normal rpthread_yield() if thread isn't ready.
+ */
+int rpthread_yield_to(rpthread_t thread) {
+	vt_advance();
+	disable_timer();
+	if (thread < scheduler->t_count)
+		scheduler->yield_target = scheduler->tcb_arr[thread];
 	schedule();
 	return 0;
 };
@@ -124,6 +284,7 @@ int rpthread_yield() {
 void rpthread_exit(void *value_ptr) {
 	if (value_ptr)
 		scheduler->running->retval = value_ptr;
+	run_key_destructors(scheduler->running);
 	scheduler->running->state = FINISHED;  // tell scheduler to terminate running thread
 	schedule();
 };
@@ -137,6 +298,8 @@ void rpthread_exit(void *value_ptr) {
  * if applicable.
  */
 int rpthread_join(rpthread_t thread, void **value_ptr) {
+	rpthread_preempt_point();
+
 	tcb_t *awaiting = scheduler->tcb_arr[thread];
 	if (awaiting->state != FINISHED) {
 		scheduler->running->state = BLOCKED;  // tell scheduler to remove it from ready queue
@@ -151,11 +314,195 @@ int rpthread_join(rpthread_t thread, void **value_ptr) {
 };
 
 
+/* 
+ * Report how much of a thread's stack was used. Needs RPTHREAD_STACK_PAINT
+ * in the environment, otherwise only *size is filled in and -1 is returned.
+ * Finished threads report the high-water mark recorded at exit.
+ */
+int rpthread_stack_usage(rpthread_t thread, size_t *used, size_t *size) {
+	if (scheduler == NULL || thread >= scheduler->t_count)
+		return -1;
+
+	tcb_t *tcb = scheduler->tcb_arr[thread];
+	*size = tcb->stack_size;
+	if (!scheduler->stack_paint || tcb->stack_size == 0)  // main thread isn't painted
+		return -1;
+
+	if (tcb->uctx == NULL) {  // already released
+		*used = tcb->stack_used;
+	}
+	else {
+		*used = stack_high_water(tcb->uctx->uc_stack.ss_sp, tcb->stack_size);
+	}
+	return 0;
+};
+
+
+/* 
+ * Set thread's priority. 0 to levels-1 is the MLFQ level the thread starts
+ * at and is boosted back to, so background work can be kept on a low level.
+ * -1 to -RPTHREAD_RT_LEVELS puts it in the real-time class, which always
+ * runs before MLFQ threads (in RR too), round robin within a priority, and
+ * is never demoted. Lower numbers run first.
+ */
+int rpthread_setpriority(rpthread_t thread, int priority) {
+	if (scheduler == NULL) {
+		init_scheduler();
+	}
+	if (priority < -RPTHREAD_RT_LEVELS || priority >= scheduler->levels)
+		return EINVAL;
+	if (thread >= scheduler->t_count)
+		return ESRCH;
+
+	disable_timer();
+	tcb_t *tcb = scheduler->tcb_arr[thread];
+	if (tcb->state == FINISHED) {
+		resume_timer();
+		return ESRCH;
+	}
+
+	tcb->base_priority = priority;
+	if (tcb->pi_held != NULL) {  // lent priorities stay until their mutexes are unlocked
+		tcb->pi_saved = priority;
+		pi_update(tcb);
+	}
+	else {
+		set_run_priority(tcb, priority);
+	}
+
+	resume_timer();
+	return 0;
+};
+
+
+/* Store thread's priority as set by rpthread_setpriority() */
+int rpthread_getpriority(rpthread_t thread, int *priority) {
+	if (scheduler == NULL) {
+		init_scheduler();
+	}
+	if (thread >= scheduler->t_count || scheduler->tcb_arr[thread]->state == FINISHED)
+		return ESRCH;
+
+	*priority = scheduler->tcb_arr[thread]->base_priority;
+	return 0;
+};
+
+
+/* 
+ * Start a one-shot EDF job on the calling thread that is due in deadline_ms.
+ * The thread is scheduled earliest deadline first, ahead of real-time and
+ * MLFQ threads, until rpthread_edf_end().
+ */
+int rpthread_edf_begin(int deadline_ms) {
+	if (deadline_ms < 1)
+		return EINVAL;
+	if (scheduler == NULL) {
+		init_scheduler();
+	}
+
+	disable_timer();
+	edf_t *edf = edf_of(scheduler->running);
+	edf->period = 0;
+	edf->relative = deadline_ms;
+	edf->budget = 0;
+	start_job(scheduler->running, now_ms());
+	schedule();  // an earlier deadline may be waiting
+	return 0;
+};
+
+
+/* 
+ * Make the calling thread a periodic EDF thread. A job is released every
+ * period_ms, is due deadline_ms after its release (period_ms if 0), and can
+ * use budget_ms of CPU (0 for no limit) before the thread falls back to its
+ * normal priority until the next release. The first job starts now, each
+ * job ends with rpthread_edf_wait_period().
+ */
+int rpthread_edf_periodic(int period_ms, int deadline_ms, int budget_ms) {
+	if (period_ms < 1 || deadline_ms < 0 || deadline_ms > period_ms || budget_ms < 0)
+		return EINVAL;
+	if (scheduler == NULL) {
+		init_scheduler();
+	}
+
+	disable_timer();
+	edf_t *edf = edf_of(scheduler->running);
+	edf->period = period_ms;
+	edf->relative = (deadline_ms == 0) ? period_ms : deadline_ms;
+	edf->budget = budget_ms;
+	start_job(scheduler->running, now_ms());
+	schedule();
+	return 0;
+};
+
+
+/* 
+ * Finish the current periodic job and sleep until the next one is
+ * released. A job that overran its period is followed by the next one
+ * straight away.
+ */
+int rpthread_edf_wait_period() {
+	if (scheduler == NULL || scheduler->running->edf == NULL || scheduler->running->edf->period == 0)
+		return EINVAL;
+
+	disable_timer();
+	tcb_t *tcb = scheduler->running;
+	edf_t *edf = tcb->edf;
+	end_job(tcb);
+
+	double now = now_ms();
+	double release = edf->release + edf->period;
+	if (release <= now) {  // overran, skip ahead instead of piling up late jobs
+		start_job(tcb, now);
+	}
+	else {
+		edf->release = release;
+		tcb->state = BLOCKED;
+
+		tcb_t **link = &scheduler->edf_sleepers;  // sorted by release
+		while (*link != NULL && (*link)->edf->release <= release) {
+			link = &(*link)->next;
+		}
+		tcb->next = *link;
+		*link = tcb;
+	}
+	schedule();
+	return 0;
+};
+
+
+/* Finish the current EDF job and return the calling thread to its normal priority */
+int rpthread_edf_end() {
+	if (scheduler == NULL || scheduler->running->edf == NULL)
+		return EINVAL;
+
+	disable_timer();
+	tcb_t *tcb = scheduler->running;
+	end_job(tcb);
+	tcb->deadline = 0;
+	tcb->edf->period = 0;
+	schedule();
+	return 0;
+};
+
+
 /* Initialize the mutex lock and blocked queue */
-int rpthread_mutex_init(rpthread_mutex_t *mutex, const pthread_mutexattr_t *mutexattr) {
+int (rpthread_mutex_init)(rpthread_mutex_t *mutex, const pthread_mutexattr_t *mutexattr) {
+	return rpthread_mutex_init_at(mutex, mutexattr, NULL, 0);
+};
+
+
+/* 
+ * rpthread_mutex_init() called from file:line, the rpthread_mutex_init()
+ * macro passes the caller's so profiling can label the mutex with it.
+ */
+int rpthread_mutex_init_at(rpthread_mutex_t *mutex, const pthread_mutexattr_t *mutexattr,
+						   const char *file, int line) {
 	mutex->lock = 0;  // 0 = unlocked, 1 = locked
 	mutex->tid = -1;  // 
 	mutex->blocked_queue = new_queue();
+	mutex->prof = new_mutex_prof(file, line);
+	mutex->pi_next = NULL;
 	return 0;
 };
 
@@ -166,19 +513,58 @@ int rpthread_mutex_init(rpthread_mutex_t *mutex, const pthread_mutexattr_t *mute
  * scheduler queue and store it under mutex blocked queue.
  */
 int rpthread_mutex_lock(rpthread_mutex_t *mutex) {
+	rpthread_preempt_point();
 
 	/* While testing, our timer would go off in the middle of this function
 	and cause a segfault. We weren't sure why that happens but disabled
 	timer anyways to prevent it. */
 	disable_timer();
 
+	rpthread_mutex_prof_t *prof = mutex->prof;
+	double wait_start = 0;
+
 	while (__sync_lock_test_and_set(&(mutex->lock), 1) == 1) {
 		scheduler->running->state = BLOCKED;  // tell scheduler to remove from queue
 		enqueue(mutex->blocked_queue, scheduler->running);  // store in mutex
+
+		/* Priority inheritance: lend the holder our priority so a lower
+		 * priority holder can't keep us waiting behind unrelated threads */
+		tcb_t *holder = scheduler->tcb_arr[mutex->tid];
+		if (holder->state != FINISHED && run_rank(scheduler->running) < run_rank(holder))
+			pi_lend(holder, mutex);
+
+		if (prof != NULL) {
+			if (wait_start == 0)
+				wait_start = now_ms();
+			if (mutex->blocked_queue->size > prof->max_queue)
+				prof->max_queue = mutex->blocked_queue->size;
+		}
 		schedule();
 	}
 
 	mutex->tid = scheduler->running->tid;  // keep track of thread that locked mutex
+
+	// waiters still queued behind us lend their priority to us now
+	for (tcb_t *waiter = mutex->blocked_queue->head; waiter != NULL; waiter = waiter->next) {
+		if (run_rank(waiter) < run_rank(scheduler->running)) {
+			pi_lend(scheduler->running, mutex);
+			break;
+		}
+	}
+
+	if (prof != NULL) {
+		prof->acquires++;
+		prof->locked_at = now_ms();
+		if (wait_start != 0) {
+			double wait = prof->locked_at - wait_start;
+			prof->contended++;
+			prof->wait_ms += wait;
+			if (wait > prof->max_wait_ms)
+				prof->max_wait_ms = wait;
+		}
+	}
+
+	resume_timer();  // holder can be preempted, waiters park on blocked_queue
 	return 0;
 };
 
@@ -189,178 +575,1824 @@ int rpthread_mutex_lock(rpthread_mutex_t *mutex) {
  */
 int rpthread_mutex_unlock(rpthread_mutex_t *mutex) {
 	if (mutex->tid == scheduler->running->tid) {  // only thread that locked can unlock
+		disable_timer();  // queues are updated below
+
+		if (mutex->prof != NULL)
+			mutex->prof->hold_ms += now_ms() - mutex->prof->locked_at;
+
 		__sync_lock_test_and_set(&(mutex->lock), 0);
 
 		/* If we put all threads back it becomes expensive, so we
-		only let the first thread that called rpthread_mutex_lock() 
-		through. Eventually all threads will be removed from this 
-		queue. */
-		if (mutex->blocked_queue->size > 0) {  // 
-			tcb_t *tcb = dequeue(mutex->blocked_queue);
-			enqueue(scheduler->thread_queues[tcb->priority], tcb);
+		only let the highest priority waiter through, the one that
+		called rpthread_mutex_lock() first among equals. Eventually 
+		all threads will be removed from this queue. */
+		tcb_t *woken = mutex->blocked_queue->head;
+		for (tcb_t *waiter = woken; waiter != NULL; waiter = waiter->next) {
+			if (run_rank(waiter) < run_rank(woken))
+				woken = waiter;
 		}
+		if (woken != NULL) {
+			queue_remove(mutex->blocked_queue, woken);
+			ready_next(woken);
+		}
+
+		// give back what waiters of this mutex lent, other held mutexes still count
+		tcb_t *running = scheduler->running;
+		if (pi_unlink(running, mutex))
+			pi_update(running);
+
+		// let a woken waiter that outranks us have the lock right away
+		if (woken != NULL && run_rank(woken) < run_rank(running))
+			rpthread_yield();
+		resume_timer();
 	}
 	
+	rpthread_preempt_point();
 	return 0;
 };
 
 
 /* Destroy mutex */
 int rpthread_mutex_destroy(rpthread_mutex_t *mutex) {
-	free(mutex->blocked_queue);
+	rpthread_free(mutex->blocked_queue);
+	mutex->prof = NULL;  // counters stay on mutex_profs for the report
 	return 0;
 };
 
 
-/********** Rpthread Private Functions **********/
-
-/* Set timer to time (ms) */
-void enable_timer(int time) {
-	itimer.it_interval.tv_sec = 0;
-	itimer.it_interval.tv_usec = time * 1000;
-	itimer.it_value = itimer.it_interval;
-
-	setitimer(ITIMER_PROF, &itimer, NULL);
-	scheduler->enabled = true;
-}
+/* Label mutex in the profiling report, no-op unless profiling */
+int rpthread_mutex_setname(rpthread_mutex_t *mutex, const char *name) {
+	if (mutex->prof != NULL) {
+		strncpy(mutex->prof->name, name, sizeof(mutex->prof->name) - 1);
+	}
+	return 0;
+};
 
-/* Disable timer for thread safety. We got weird results when we used 
- * setitimer() on a zeroed itimerval, so we just set a bool to ignore
- * timeouts.
- */
-void disable_timer() {
-	scheduler->enabled = false;
-}
 
+/* Print every profiled mutex to stderr, most time spent waiting first */
+void rpthread_mutex_report() {
+	size_t n = 0;
+	for (rpthread_mutex_prof_t *prof = mutex_profs; prof != NULL; prof = prof->next) {
+		n++;
+	}
+	if (n == 0)
+		return;
 
-/* Signal handler for timer timeouts */
-void handle_timeout(int signum) {
-	if (scheduler->enabled) {  // ignore timeout if enabled=false
-		tcb_t *running = scheduler->running;
-		if (running->priority < MLFQ_LEVELS-1) {  // thread used all its timeslice 
-			running->priority++;
-		}
-		schedule();
+	rpthread_mutex_prof_t **sorted = malloc(n * sizeof(*sorted));
+	n = 0;
+	for (rpthread_mutex_prof_t *prof = mutex_profs; prof != NULL; prof = prof->next) {
+		sorted[n++] = prof;
 	}
-}
+	qsort(sorted, n, sizeof(*sorted), cmp_mutex_wait);
+
+	fprintf(stderr, "rpthread: %-31s %10s %10s %10s %10s %10s %6s\n", "mutex",
+			"acquires", "contended", "wait ms", "max wait", "hold ms", "queue");
+	for (size_t i=0; i < n; i++) {
+		rpthread_mutex_prof_t *prof = sorted[i];
+		fprintf(stderr, "rpthread: %-31s %10lu %10lu %10.2f %10.2f %10.2f %6u\n",
+				prof->name, prof->acquires, prof->contended, prof->wait_ms,
+				prof->max_wait_ms, prof->hold_ms, prof->max_queue);
+	}
+	free(sorted);
+};
 
-/* Runs after thread completes */
-void handle_exit() {
-	scheduler->running->state = FINISHED;
-	schedule();
-}
+
+/* Initialize an unlocked rwlock with empty reader and writer queues */
+int rpthread_rwlock_init(rpthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr) {
+	rwlock->readers = 0;
+	rwlock->writer = false;
+	rwlock->wtid = -1;
+	rwlock->writers_waiting = 0;
+	rwlock->read_queue = new_queue();
+	rwlock->write_queue = new_queue();
+	return 0;
+};
 
 
 /* 
- * Simple RR scheduler. Assumes that all threads in the queue are ready,
- * (blocked threads from rpthread_join() and rpthread_mutex_lock() are already
- * removed from queue by scheduler). After this function returns, 
- * scheduler->running will be the next thread to run.
+ * Take a shared lock. Writers are preferred, so a reader also parks while 
+ * any writer is waiting, otherwise a steady stream of readers could keep 
+ * the lock forever.
  */
-static void sched_rr() {
-	queue_t *queue = scheduler->thread_queues[0];  // only use first queue
+int rpthread_rwlock_rdlock(rpthread_rwlock_t *rwlock) {
+	rpthread_preempt_point();
+	disable_timer();
 
-	if (queue->size == 0)  // no other threads avaliable (except running)
-		return;  		   // let running continue
+	while (rwlock->writer || rwlock->writers_waiting > 0) {
+		block_on(rwlock->read_queue);
+	}
+	rwlock->readers++;
 
-	enqueue(queue, scheduler->running);
-	scheduler->running = dequeue(queue);  // schedule from front of queue
-}
+	resume_timer();
+	return 0;
+};
 
-/* 
- * MLFQ scheduler with 8 levels. Searches all levels starting from highest
- * priority for a ready thread. If scheduler->running is the highest priority,
- * it will continue execution. After this function returns, scheduler->running 
- * will be the next thread to run.
- */
-static void sched_mlfq() {
-	tcb_t *running = scheduler->running;
 
-	/* If scheduler->running is the highest priority out of all ready
-	 * threads, there's no need to enqueue() and dequeue() it, we can
-	 * just let it keep running. We need to search for highest priority
-	 * in the queue and compare it to scheduler->running. */
+/* Take an exclusive lock, parking until all readers and the writer are gone */
+int rpthread_rwlock_wrlock(rpthread_rwlock_t *rwlock) {
+	rpthread_preempt_point();
+	disable_timer();
 
-	int level = 0;  // set level to first level with ready thread
-	for (; level < MLFQ_LEVELS; level++) {
-		if (scheduler->thread_queues[level]->size > 0) {
-			break;
-		}
+	while (rwlock->writer || rwlock->readers > 0) {
+		rwlock->writers_waiting++;
+		block_on(rwlock->write_queue);
+		rwlock->writers_waiting--;
 	}
+	rwlock->writer = true;
+	rwlock->wtid = scheduler->running->tid;
 
-	// If running == NULL bc of blocking, we cant access running->priority
-	if (running != NULL) {
-		if (level > running->priority)  // scheduler->running is highest priority
-			return;
-		else {
-			enqueue(scheduler->thread_queues[running->priority], running);  // put back in queue
-		}
-	}
-	scheduler->running = dequeue(scheduler->thread_queues[level]);
-}
+	resume_timer();
+	return 0;
+};
 
 
-/* 
- * Main scheduler function. Called everytime we want to switch threads or handle
- * a finished thread. On function call, scheduler->running is the previously running
- * thread. A call to schedule() will return when thread exectuion is handed back
- * to the calling thread. Since this function is critical and may take a while to
- * run, timer is disabled to make it thread safe.
- */
-static void schedule() {
-	disable_timer();  // disable itimer
+/* Non-blocking rdlock(), returns EBUSY instead of parking */
+int rpthread_rwlock_tryrdlock(rpthread_rwlock_t *rwlock) {
+	disable_timer();
 
-	clock_t curr_time = clock();  // get time to calculate thread runtime
+	int ret = EBUSY;
+	if (!rwlock->writer && rwlock->writers_waiting == 0) {
+		rwlock->readers++;
+		ret = 0;
+	}
 
-	tcb_t *old_tcb = scheduler->running;
-	bool no_save = (old_tcb->state == FINISHED);  // use set_context() instead of swap_context()
+	resume_timer();
+	return ret;
+};
 
-	// called from rpthread_exit()
-	if (old_tcb->state == FINISHED) {
-		// add threads back from joined queue
-		tcb_t *curr = old_tcb->joined->head;
-		while (curr != NULL) {
-			curr->state = READY;
-			enqueue(scheduler->thread_queues[curr->priority], curr);
-			curr = curr->next;
-		}
 
-		free(old_tcb->joined);
-		free(old_tcb->uctx->uc_stack.ss_sp);
-		free(old_tcb->uctx);
+/* Non-blocking wrlock(), returns EBUSY instead of parking */
+int rpthread_rwlock_trywrlock(rpthread_rwlock_t *rwlock) {
+	disable_timer();
 
-		scheduler->running = NULL;
-	}
-	else if (old_tcb->state == BLOCKED) {
-		scheduler->running = NULL;  // blocked thread doesn't belong in queue
+	int ret = EBUSY;
+	if (!rwlock->writer && rwlock->readers == 0) {
+		rwlock->writer = true;
+		rwlock->wtid = scheduler->running->tid;
+		ret = 0;
 	}
 
+	resume_timer();
+	return ret;
+};
 
-	/* This section prevents gaming MLFQ. If a thread uses the whole TIMESLICE, we
-	reduce its priority. This prevents a thread from calling rpthread_yield() to
-	stay at highest priority level. */
-	if (old_tcb->priority < MLFQ_LEVELS-1) {
-		/* Calculate thread runtime from clock() */
-		double ms_used = (old_tcb->last_run == 0) ? 
-			0 : ((double)(curr_time - old_tcb->last_run)) / CLOCKS_PER_SEC * 1000;
 
-		old_tcb->timeslice -= ms_used;
-		if (old_tcb->timeslice <= 0) {  // exhausted timeslice, increase priority
-			if (old_tcb->priority < MLFQ_LEVELS-1) {
-				old_tcb->priority++;
+/* 
+ * Release either kind of lock. A leaving writer hands off to the next 
+ * writer if there is one, otherwise it wakes every parked reader in one 
+ * pass. The last reader out wakes one writer.
+ */
+int rpthread_rwlock_unlock(rpthread_rwlock_t *rwlock) {
+	disable_timer();
+
+	if (rwlock->writer) {
+		if (rwlock->wtid != scheduler->running->tid) {  // only writer can unlock
+			resume_timer();
+			return EPERM;
+		}
+		rwlock->writer = false;
+		rwlock->wtid = -1;
+
+		if (rwlock->write_queue->size > 0) {
+			ready_thread(dequeue(rwlock->write_queue));
+		}
+		else {
+			while (rwlock->read_queue->size > 0) {
+				ready_thread(dequeue(rwlock->read_queue));
 			}
-			old_tcb->timeslice = TIMESLICE;
+		}
+	}
+	else if (rwlock->readers > 0) {
+		rwlock->readers--;
+		if (rwlock->readers == 0 && rwlock->write_queue->size > 0) {
+			ready_thread(dequeue(rwlock->write_queue));
 		}
 	}
 
-	#ifdef MLFQ
+	resume_timer();
+	rpthread_preempt_point();
+	return 0;
+};
+
+
+/* Destroy rwlock */
+int rpthread_rwlock_destroy(rpthread_rwlock_t *rwlock) {
+	rpthread_free(rwlock->read_queue);
+	rpthread_free(rwlock->write_queue);
+	return 0;
+};
+
+
+/* Initialize seqlock, the sequence starts even (no write in progress) */
+int (rpthread_seqlock_init)(rpthread_seqlock_t *seqlock) {
+	return rpthread_seqlock_init_at(seqlock, NULL, 0);
+};
+
+
+/* rpthread_seqlock_init() called from file:line, labels the write lock */
+int rpthread_seqlock_init_at(rpthread_seqlock_t *seqlock, const char *file, int line) {
+	seqlock->seq = 0;
+	return rpthread_mutex_init_at(&seqlock->write_lock, NULL, file, line);
+};
+
+
+/* 
+ * Start a write. Writers are serialized by a mutex, readers never block
+ * and instead retry if the sequence moved while they were reading.
+ */
+void rpthread_seqlock_write_lock(rpthread_seqlock_t *seqlock) {
+	rpthread_mutex_lock(&seqlock->write_lock);
+	seqlock->seq++;  // odd: write in progress
+	__sync_synchronize();
+};
+
+
+/* Finish a write, making the sequence even again */
+void rpthread_seqlock_write_unlock(rpthread_seqlock_t *seqlock) {
+	__sync_synchronize();
+	seqlock->seq++;
+	rpthread_mutex_unlock(&seqlock->write_lock);
+};
+
+
+/* Destroy seqlock */
+int rpthread_seqlock_destroy(rpthread_seqlock_t *seqlock) {
+	return rpthread_mutex_destroy(&seqlock->write_lock);
+};
+
+
+/* 
+ * Reserve a free TLS slot. Slot values live in every tcb's specific[] array, 
+ * so get/set are a single index off scheduler->running. The destructor (may
+ * be NULL) runs on the exiting thread for every non-NULL value.
+ */
+int rpthread_key_create(rpthread_key_t *key, void (*destructor)(void *)) {
+	if (scheduler == NULL) {  // keys can be created before the first thread
+		init_scheduler();
+	}
+
+	for (rpthread_key_t k=0; k < RPTHREAD_KEYS_MAX; k++) {
+		if (!scheduler->key_used[k]) {
+			scheduler->key_used[k] = true;
+			scheduler->key_dtors[k] = destructor;
+			*key = k;
+			return 0;
+		}
+	}
+	return EAGAIN;  // out of keys
+};
+
+
+/* 
+ * Release a TLS slot. Destructors are not called, but stale values are 
+ * cleared from every thread so the slot starts empty when it gets reused.
+ */
+int rpthread_key_delete(rpthread_key_t key) {
+	if (scheduler == NULL || key >= RPTHREAD_KEYS_MAX || !scheduler->key_used[key])
+		return EINVAL;
+
+	for (int i=0; i < scheduler->t_count; i++) {
+		scheduler->tcb_arr[i]->specific[key] = NULL;
+	}
+	scheduler->key_used[key] = false;
+	scheduler->key_dtors[key] = NULL;
+	return 0;
+};
+
+
+/* Return calling thread's value for key, NULL if never set */
+void* rpthread_getspecific(rpthread_key_t key) {
+	if (key >= RPTHREAD_KEYS_MAX)
+		return NULL;
+	return scheduler->running->specific[key];
+};
+
+
+/* Set calling thread's value for key */
+int rpthread_setspecific(rpthread_key_t key, const void *value) {
+	if (scheduler == NULL || key >= RPTHREAD_KEYS_MAX || !scheduler->key_used[key])
+		return EINVAL;
+	scheduler->running->specific[key] = (void *)value;
+	return 0;
+};
+
+
+/* 
+ * Run function(arg) on a new thread and return a future for its result.
+ * Waiters park on the future instead of a specific thread, so results can
+ * be gathered with wait_any()/wait_all() or chained with then().
+ */
+rpthread_future_t* rpthread_async(void *(*function)(void *), void *arg) {
+	rpthread_future_t *future = new_future(function, arg);
+	spawn_future(future);
+	return future;
+};
+
+
+/* Park until future is ready and return its value */
+void* rpthread_future_get(rpthread_future_t *future) {
+	rpthread_future_wait_any(&future, 1);
+	return future->value;
+};
+
+
+/* 
+ * Park until at least one of the n futures is ready and return its index.
+ * The caller is registered as a watcher on every pending future and the 
+ * first one to resolve wakes it, the others drop the registration after.
+ * Returns -1 if n < 1, there would be nothing to wake the caller.
+ */
+int rpthread_future_wait_any(rpthread_future_t **futures, int n) {
+	if (n < 1)
+		return -1;
+
+	rpthread_preempt_point();
+	disable_timer();
+
+	for (int i=0; i < n; i++) {
+		if (futures[i]->ready) {
+			resume_timer();
+			return i;
+		}
+	}
+
+	future_watch_t *watches = rpthread_malloc(n * sizeof(*watches));
+	for (int i=0; i < n; i++) {
+		watches[i].tcb = scheduler->running;
+		watches[i].next = futures[i]->watchers;
+		futures[i]->watchers = &watches[i];
+	}
+
+	scheduler->running->state = BLOCKED;  // woken by future_resolve()
+	schedule();
+	disable_timer();
+
+	int first = -1;
+	for (int i=0; i < n; i++) {
+		if (futures[i]->ready) {
+			if (first < 0)
+				first = i;
+			continue;  // resolving already cleared the watcher list
+		}
+
+		future_watch_t **link = &futures[i]->watchers;
+		while (*link != &watches[i]) {
+			link = &(*link)->next;
+		}
+		*link = watches[i].next;
+	}
+	rpthread_free(watches);
+
+	resume_timer();
+	return first;
+};
+
+
+/* Park until all n futures are ready */
+int rpthread_future_wait_all(rpthread_future_t **futures, int n) {
+	for (int i=0; i < n; i++) {
+		rpthread_future_get(futures[i]);
+	}
+	return 0;
+};
+
+
+/* 
+ * Chain function onto future. Once future is ready, function runs on a new
+ * thread with future's value as its argument. Returns a future for the
+ * continuation's own result.
+ */
+rpthread_future_t* rpthread_future_then(rpthread_future_t *future, void *(*function)(void *)) {
+	rpthread_future_t *next = new_future(function, NULL);
+
+	disable_timer();
+
+	if (future->ready) {
+		next->arg = future->value;
+		spawn_future(next);  // re-enables timer
+	}
+	else {
+		next->next_then = future->thens;
+		future->thens = next;
+		resume_timer();
+	}
+	return next;
+};
+
+
+/* Free future, nobody may be waiting on it */
+void rpthread_future_destroy(rpthread_future_t *future) {
+	rpthread_free(future);
+};
+
+
+/* 
+ * Start a pool with min_workers parked workers that grows up to max_workers
+ * under load. min_workers == max_workers gives a fixed size pool.
+ */
+int rpthread_pool_init(rpthread_pool_t *pool, int min_workers, int max_workers) {
+	if (min_workers < 0 || max_workers < 1 || min_workers > max_workers)
+		return EINVAL;
+	if (scheduler == NULL) {
+		init_scheduler();
+	}
+
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->workers = 0;
+	pool->min_workers = min_workers;
+	pool->max_workers = max_workers;
+	pool->shutdown = false;
+	pool->idle = new_queue();
+	pool->joiners = new_queue();
+
+	for (int i=0; i < min_workers; i++) {
+		spawn_worker(pool);
+	}
+	return 0;
+};
+
+
+/* 
+ * Queue function(arg) to run on a pool worker and return a future for its
+ * result. Wakes a parked worker, or starts one if all are busy and the pool
+ * is below max_workers. Returns NULL after rpthread_pool_shutdown().
+ */
+rpthread_future_t* rpthread_pool_submit(rpthread_pool_t *pool, void *(*function)(void *), void *arg) {
+	if (pool->shutdown)
+		return NULL;
+
+	rpthread_preempt_point();
+	rpthread_future_t *job = new_future(function, arg);
+
+	if (scheduler == NULL) {
+		init_scheduler();
+	}
+	disable_timer();
+
+	if (pool->tail == NULL)
+		pool->head = job;
+	else
+		pool->tail->next_then = job;
+	pool->tail = job;
+
+	if (pool->idle->size > 0) {
+		ready_thread(dequeue(pool->idle));
+		resume_timer();
+	}
+	else if (pool->workers < pool->max_workers) {
+		resume_timer();
+		spawn_worker(pool);
+	}
+	else {
+		resume_timer();
+	}
+	return job;
+};
+
+
+/* 
+ * Stop taking jobs and wait until the workers have run every queued job
+ * and exited. Futures of submitted jobs stay valid.
+ */
+int rpthread_pool_shutdown(rpthread_pool_t *pool) {
+	if (scheduler == NULL) {
+		init_scheduler();
+	}
+	disable_timer();
+
+	pool->shutdown = true;
+	while (pool->idle->size > 0) {
+		ready_thread(dequeue(pool->idle));
+	}
+	while (pool->workers > 0) {
+		block_on(pool->joiners);
+	}
+
+	rpthread_free(pool->idle);
+	rpthread_free(pool->joiners);
+	resume_timer();
+	return 0;
+};
+
+
+/* Copy current MLFQ settings into config */
+int rpthread_sched_getconfig(rpthread_sched_config_t *config) {
+	if (scheduler == NULL) {
+		init_scheduler();
+	}
+
+	config->levels = scheduler->levels;
+	config->boost_ms = scheduler->boost_ms;
+	for (int l=0; l < MLFQ_LEVELS; l++) {
+		config->quantum[l] = scheduler->quantum[l];
+		config->allotment[l] = scheduler->allotment[l];
+	}
+	return 0;
+};
+
+
+/* 
+ * Change MLFQ settings at runtime. Threads on levels that no longer exist
+ * move to the new lowest level. Returns EINVAL for out of range values.
+ */
+int rpthread_sched_setconfig(const rpthread_sched_config_t *config) {
+	if (config->levels < 1 || config->levels > MLFQ_LEVELS || config->boost_ms < 0)
+		return EINVAL;
+	for (int l=0; l < config->levels; l++) {
+		if (config->quantum[l] < 1 || config->allotment[l] < 1)
+			return EINVAL;
+	}
+
+	if (scheduler == NULL) {
+		init_scheduler();
+	}
+	disable_timer();
+
+	int last = config->levels - 1;
+	for (int l=config->levels; l < scheduler->levels; l++) {  // fold removed levels
+		queue_t *queue = scheduler->thread_queues[l];
+		while (queue->size > 0) {
+			enqueue(scheduler->thread_queues[last], dequeue(queue));
+		}
+	}
+	for (uint32_t i=0; i < scheduler->t_count; i++) {
+		tcb_t *tcb = scheduler->tcb_arr[i];
+		if (tcb->state != FINISHED && tcb->priority > last)
+			tcb->priority = last;
+		if (tcb->base_priority > last)
+			tcb->base_priority = last;
+	}
+
+	scheduler->levels = config->levels;
+	scheduler->boost_ms = config->boost_ms;
+	for (int l=0; l < MLFQ_LEVELS; l++) {
+		scheduler->quantum[l] = config->quantum[l];
+		scheduler->allotment[l] = config->allotment[l];
+	}
+
+	resume_timer();
+	return 0;
+};
+
+
+/* Copy per-level scheduler counters into stats */
+int rpthread_sched_getstats(rpthread_sched_stats_t *stats) {
+	if (scheduler == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return 0;
+	}
+
+	disable_timer();
+	*stats = scheduler->stats;
+	resume_timer();
+	return 0;
+};
+
+
+/* 
+ * Allocate from the calling thread's arena. Timeouts that arrive meanwhile
+ * are deferred until the allocation is done, so a thread is never switched
+ * out with allocator state half updated.
+ */
+void* rpthread_malloc(size_t size) {
+	rpthread_preempt_disable();
+	void *ptr = arena_alloc(current_arena(), size);
+	rpthread_preempt_enable();
+	return ptr;
+};
+
+
+/* Zeroed rpthread_malloc() */
+void* rpthread_calloc(size_t count, size_t size) {
+	void *ptr = rpthread_malloc(count * size);
+	if (ptr != NULL)
+		memset(ptr, 0, count * size);
+	return ptr;
+};
+
+
+/* Free a block from rpthread_malloc(), it goes to the caller's arena */
+void rpthread_free(void *ptr) {
+	if (ptr == NULL)
+		return;
+
+	rpthread_preempt_disable();
+	arena_free(current_arena(), ptr);
+	rpthread_preempt_enable();
+};
+
+
+/* 
+ * Defer timer preemption of the running thread. Calls nest, and a timeout
+ * that arrives in between is handled by the outermost enable.
+ */
+void rpthread_preempt_disable() {
+	if (scheduler != NULL)
+		scheduler->preempt_off++;
+};
+
+
+void rpthread_preempt_enable() {
+	if (scheduler == NULL || --scheduler->preempt_off > 0)
+		return;
+
+	if (scheduler->preempt_pending && scheduler->enabled) {
+		scheduler->preempt_pending = false;
+		preempt();
+	}
+};
+
+
+/* 
+ * Initialize an empty thread group. share is the percent of CPU time the 
+ * group's threads may use per GROUP_SHARE_PERIOD while threads outside the
+ * group are waiting, 0 for no limit.
+ */
+int rpthread_group_init(rpthread_group_t *group, int share) {
+	if (share < 0 || share > 100)
+		return EINVAL;
+	if (scheduler == NULL) {
+		init_scheduler();
+	}
+
+	group->live = 0;
+	group->joiners = new_queue();
+	group->share = share;
+	group->used_ms = 0;
+	group->next = NULL;
+
+	if (share > 0) {
+		disable_timer();
+		group->next = scheduler->share_groups;
+		scheduler->share_groups = group;
+		resume_timer();
+	}
+	return 0;
+};
+
+
+/* rpthread_create() into group */
+int rpthread_group_create(rpthread_group_t *group, rpthread_t *thread, pthread_attr_t *attr,
+						  void *(*function)(void *), void *arg) {
+	rpthread_preempt_disable();  // new thread must not finish before it is counted
+
+	int ret = rpthread_create(thread, attr, function, arg);
+	if (ret == 0) {
+		scheduler->tcb_arr[*thread]->group = group;
+		group->live++;
+	}
+
+	rpthread_preempt_enable();
+	return ret;
+};
+
+
+/* rpthread_create_n() into group */
+int rpthread_group_create_n(rpthread_group_t *group, rpthread_t *threads, int n, pthread_attr_t *attr,
+							void *(*function)(void *), void *args, size_t stride) {
+	rpthread_preempt_disable();
+
+	int ret = rpthread_create_n(threads, n, attr, function, args, stride);
+	if (ret == 0) {
+		for (int i=0; i < n; i++) {
+			scheduler->tcb_arr[threads[i]]->group = group;
+		}
+		group->live += n;
+	}
+
+	rpthread_preempt_enable();
+	return ret;
+};
+
+
+/* 
+ * Park until every thread in group has finished. The caller is woken once
+ * by the last thread instead of once per joined thread.
+ */
+int rpthread_group_join(rpthread_group_t *group) {
+	rpthread_preempt_point();
+	disable_timer();
+
+	while (group->live > 0) {
+		block_on(group->joiners);
+	}
+
+	resume_timer();
+	return 0;
+};
+
+
+/* Destroy group, its threads must have finished */
+int rpthread_group_destroy(rpthread_group_t *group) {
+	disable_timer();
+
+	rpthread_group_t **link = &scheduler->share_groups;
+	while (*link != NULL && *link != group) {
+		link = &(*link)->next;
+	}
+	if (*link != NULL)
+		*link = group->next;
+
+	resume_timer();
+	rpthread_free(group->joiners);
+	return 0;
+};
+
+
+/********** Rpthread Private Functions **********/
+
+/* 
+ * Arena of the running thread. Threads take a spare arena left behind by
+ * a finished thread before making a new one. Allocations made before 
+ * there is a running thread come from boot_arena.
+ */
+static arena_t* current_arena() {
+	if (scheduler == NULL || scheduler->running == NULL)
+		return &boot_arena;
+
+	tcb_t *running = scheduler->running;
+	if (running->arena == NULL) {
+		if (scheduler->spare_arenas != NULL) {
+			running->arena = scheduler->spare_arenas;
+			scheduler->spare_arenas = running->arena->next;
+		}
+		else {
+			running->arena = new_arena();
+			if (running->arena == NULL)  // out of memory, share the boot arena
+				return &boot_arena;
+		}
+	}
+	return running->arena;
+}
+
+/* Allocate a pending future that will run function(arg) */
+static rpthread_future_t* new_future(void *(*function)(void *), void *arg) {
+	rpthread_future_t *future = rpthread_malloc(sizeof(*future));
+	future->ready = false;
+	future->value = NULL;
+	future->tid = -1;
+	future->watchers = NULL;
+	future->thens = NULL;
+	future->next_then = NULL;
+	future->func = function;
+	future->arg = arg;
+	return future;
+}
+
+/* Start the thread that computes future */
+static void spawn_future(rpthread_future_t *future) {
+	rpthread_create(&future->tid, NULL, future_body, future);
+}
+
+/* Thread body for futures, stores the result and wakes waiters */
+static void* future_body(void *arg) {
+	rpthread_future_t *future = arg;
+	void *value = future->func(future->arg);
+	future_resolve(future, value);
+	return value;
+}
+
+/* 
+ * Publish value, wake every thread parked in wait_any() on this future and
+ * start its continuations. A waiter watching several futures is only woken 
+ * by the first, after that it is no longer BLOCKED.
+ */
+static void future_resolve(rpthread_future_t *future, void *value) {
+	disable_timer();
+
+	future->value = value;
+	future->ready = true;
+
+	for (future_watch_t *w = future->watchers; w != NULL; w = w->next) {
+		if (w->tcb->state == BLOCKED)
+			ready_thread(w->tcb);
+	}
+	future->watchers = NULL;
+
+	rpthread_future_t *then = future->thens;
+	future->thens = NULL;
+	resume_timer();
+
+	while (then != NULL) {
+		rpthread_future_t *next = then->next_then;
+		then->arg = value;
+		spawn_future(then);
+		then = next;
+	}
+}
+
+/* Add a worker thread to pool */
+static void spawn_worker(rpthread_pool_t *pool) {
+	rpthread_t tid;
+
+	disable_timer();
+	pool->workers++;
+	resume_timer();
+
+	if (rpthread_create(&tid, NULL, pool_worker, pool) != 0) {
+		disable_timer();
+		pool->workers--;
+		resume_timer();
+	}
+}
+
+/* 
+ * Pool worker body. Runs queued jobs until the queue is empty, then parks
+ * on pool->idle, or exits if the pool has more than min_workers or is shut
+ * down. The last worker out wakes rpthread_pool_shutdown().
+ */
+static void* pool_worker(void *arg) {
+	rpthread_pool_t *pool = arg;
+
+	disable_timer();
+	for (;;) {
+		while (pool->head == NULL && !pool->shutdown && pool->workers <= pool->min_workers) {
+			block_on(pool->idle);
+		}
+		if (pool->head == NULL)
+			break;
+
+		rpthread_future_t *job = pool->head;
+		pool->head = job->next_then;
+		if (pool->head == NULL)
+			pool->tail = NULL;
+		job->next_then = NULL;
+		resume_timer();
+
+		future_resolve(job, job->func(job->arg));
+		disable_timer();
+	}
+
+	if (--pool->workers == 0) {
+		while (pool->joiners->size > 0) {
+			ready_thread(dequeue(pool->joiners));
+		}
+	}
+	resume_timer();
+	return NULL;
+}
+
+/* 
+ * Put a woken thread back in the scheduler queue for its priority level. 
+ * RR only ever schedules from the first queue.
+ */
+static void ready_thread(tcb_t *tcb) {
+	tcb->state = READY;
+	requeue(tcb);
+}
+
+/* 
+ * Wake tcb into the run-next slot so it runs as soon as its waker gives up
+ * the CPU, while the data they share is still in cache. A thread already
+ * in the slot goes to its queue. EDF threads are ordered by the heap instead.
+ */
+static void ready_next(tcb_t *tcb) {
+	if (tcb->deadline > 0) {
+		ready_thread(tcb);
+		return;
+	}
+	tcb->state = READY;
+	if (scheduler->run_next != NULL)
+		requeue(scheduler->run_next);
+	scheduler->run_next = tcb;
+}
+
+/* Put a ready tcb where the scheduler looks for its class: EDF heap or queue */
+static void requeue(tcb_t *tcb) {
+	if (tcb->deadline > 0)
+		heap_push(scheduler->edf_heap, tcb);
+	else
+		enqueue(ready_queue(tcb), tcb);
+}
+
+/* Take tcb out of the EDF heap or its ready queue, false if it wasn't there */
+static bool unqueue(tcb_t *tcb) {
+	if (scheduler->run_next == tcb) {
+		scheduler->run_next = NULL;
+		return true;
+	}
+	if (tcb->deadline > 0)
+		return heap_remove(scheduler->edf_heap, tcb) != NULL;
+	return queue_remove(ready_queue(tcb), tcb) != NULL;
+}
+
+/* Scheduler queue a ready tcb waits in */
+static queue_t* ready_queue(tcb_t *tcb) {
+	if (tcb->priority < 0)
+		return scheduler->rt_queues[RPTHREAD_RT_LEVELS + tcb->priority];
+
+	#ifdef MLFQ
+		return scheduler->thread_queues[tcb->priority];
+	#else
+		return scheduler->thread_queues[0];
+	#endif
+}
+
+/* 
+ * Switch to the rpthread_yield_to() target if it is still waiting in its
+ * ready queue. It runs on the left ms of the caller's timeslice, so threads
+ * yielding to each other share one timeslice like sched_run_next(). The
+ * caller goes back in its own queue. Returns false if the slice is used up
+ * or the target can't run yet so the normal scheduler picks instead.
+ */
+static bool sched_yield_to(tcb_t *target, int left) {
+	tcb_t *running = scheduler->running;
+	if (left < 1 || target == running || target->state != READY)
+		return false;
+
+	// the caller steps aside, only waiting threads can outrank target
+	scheduler->running = NULL;
+	bool held_back = outranked(target) || over_share(target);
+	scheduler->running = running;
+	if (held_back || !unqueue(target))
+		return false;
+
+	if (running != NULL)
+		requeue(running);
+	scheduler->running = target;
+	return true;
+}
+
+/* 
+ * Park running thread on queue until someone calls ready_thread() on it.
+ * Must be called with timer disabled, and returns with it disabled again
+ * so the caller can recheck its condition safely.
+ */
+static void block_on(queue_t *queue) {
+	scheduler->running->state = BLOCKED;  // tell scheduler to remove from queue
+	enqueue(queue, scheduler->running);
+	schedule();
+	disable_timer();
+}
+
+/* Stack size requested through attr, SS_SIZE if there is no attr */
+static size_t attr_stack_size(pthread_attr_t *attr) {
+	size_t size = SS_SIZE;
+	if (attr != NULL)
+		pthread_attr_getstacksize(attr, &size);
+	return size;
+}
+
+/* Save a finished thread's stack high-water mark and add it to the totals */
+static void record_stack_usage(tcb_t *tcb) {
+	tcb->stack_used = stack_high_water(tcb->uctx->uc_stack.ss_sp, tcb->stack_size);
+
+	scheduler->stack_reports++;
+	scheduler->stack_used_total += tcb->stack_used;
+	if (tcb->stack_used > scheduler->stack_used_max)
+		scheduler->stack_used_max = tcb->stack_used;
+
+	fprintf(stderr, "rpthread: thread %u stack high-water %zu / %zu bytes\n",
+			tcb->tid, tcb->stack_used, tcb->stack_size);
+}
+
+/* atexit() summary of every thread's stack high-water mark */
+static void report_stack_usage() {
+	if (scheduler->reap != NULL) {  // last finished thread hasn't been released yet
+		record_stack_usage(scheduler->reap);
+	}
+	if (scheduler->stack_reports == 0)
+		return;
+
+	fprintf(stderr, "rpthread: %u threads, stack high-water max %zu bytes, avg %zu bytes\n",
+			scheduler->stack_reports, scheduler->stack_used_max,
+			scheduler->stack_used_total / scheduler->stack_reports);
+}
+
+/* 
+ * Add ms_used to the running thread's group. Usage of every share group 
+ * is reset each time GROUP_SHARE_PERIOD ms of CPU time have been handed out.
+ */
+static void charge_group(tcb_t *tcb, double ms_used) {
+	if (scheduler->share_groups == NULL)
+		return;
+
+	if (tcb->group != NULL)
+		tcb->group->used_ms += ms_used;
+
+	scheduler->share_period_ms += ms_used;
+	if (scheduler->share_period_ms >= GROUP_SHARE_PERIOD) {
+		for (rpthread_group_t *g = scheduler->share_groups; g != NULL; g = g->next) {
+			g->used_ms = 0;
+		}
+		scheduler->share_period_ms = 0;
+	}
+}
+
+/* True if tcb's group has used up its share of the current period */
+static bool over_share(tcb_t *tcb) {
+	rpthread_group_t *group = tcb->group;
+	return group != NULL && group->share > 0
+		&& group->used_ms >= (double)group->share * GROUP_SHARE_PERIOD / 100;
+}
+
+/* First thread in queue that isn't over its group's share */
+static tcb_t* first_under_share(queue_t *queue) {
+	for (tcb_t *curr = queue->head; curr != NULL; curr = curr->next) {
+		if (!over_share(curr))
+			return curr;
+	}
+	return NULL;
+}
+
+/* 
+ * Parse a comma separated list of ms values into out[], at most 
+ * MLFQ_LEVELS. Levels past the end of the list double the last value.
+ * Returns false if str is NULL or has no numbers.
+ */
+static bool parse_levels(const char *str, int *out) {
+	if (str == NULL)
+		return false;
+
+	int n = 0;
+	char *end;
+	while (n < MLFQ_LEVELS) {
+		long v = strtol(str, &end, 10);
+		if (end == str || v < 1)
+			break;
+		out[n++] = v;
+		if (*end != ',')
+			break;
+		str = end + 1;
+	}
+	if (n == 0)
+		return false;
+
+	for (int l=n; l < MLFQ_LEVELS; l++) {
+		out[l] = out[l-1] * 2;
+	}
+	return true;
+}
+
+/* 
+ * Default MLFQ settings, overridden by environment variables:
+ *   RPTHREAD_LEVELS      number of levels in use (1 - MLFQ_LEVELS)
+ *   RPTHREAD_QUANTA      ms per level, "5" or "5,10,40", defaults to 
+ *                        TIMESLICE doubling per level
+ *   RPTHREAD_ALLOTMENTS  ms a thread can use on a level before it is
+ *                        demoted, defaults to that level's quantum
+ *   RPTHREAD_BOOST_MS    move every thread back to level 0 this often,
+ *                        0 (default) never
+ *   RPTHREAD_SCHED_STATS print per-level counters at exit
+ *   RPTHREAD_VIRTUAL_TIME deterministic mode: no SIGPROF, the clock only
+ *                        moves by RPTHREAD_VIRTUAL_TICK_US (default 100) at
+ *                        every rpthread_preempt_point()
+ *   RPTHREAD_SEED        pick among equal ready threads with this seed
+ *                        instead of FIFO
+ */
+static void init_sched_config() {
+	char *env;
+
+	scheduler->levels = MLFQ_LEVELS;
+	if ((env = getenv("RPTHREAD_LEVELS")) != NULL) {
+		int levels = atoi(env);
+		if (levels >= 1 && levels <= MLFQ_LEVELS)
+			scheduler->levels = levels;
+	}
+
+	if (!parse_levels(getenv("RPTHREAD_QUANTA"), scheduler->quantum)) {
+		for (int l=0; l < MLFQ_LEVELS; l++) {
+			scheduler->quantum[l] = TIMESLICE << l;
+		}
+	}
+	if (!parse_levels(getenv("RPTHREAD_ALLOTMENTS"), scheduler->allotment)) {
+		memcpy(scheduler->allotment, scheduler->quantum, sizeof(scheduler->allotment));
+	}
+
+	scheduler->boost_ms = 0;
+	if ((env = getenv("RPTHREAD_BOOST_MS")) != NULL && atoi(env) > 0)
+		scheduler->boost_ms = atoi(env);
+
+	if ((env = getenv("RPTHREAD_SCHED_STATS")) != NULL && strcmp(env, "0") != 0)
+		atexit(report_sched_stats);
+
+	env = getenv("RPTHREAD_VIRTUAL_TIME");
+	scheduler->virtual_time = (env != NULL && strcmp(env, "0") != 0);
+	scheduler->vtick_ms = 0.1;
+	if ((env = getenv("RPTHREAD_VIRTUAL_TICK_US")) != NULL && atoi(env) > 0)
+		scheduler->vtick_ms = atoi(env) / 1000.0;
+
+	if ((env = getenv("RPTHREAD_SEED")) != NULL)
+		scheduler->rng = strtoull(env, NULL, 10);
+}
+
+/* atexit() dump of rpthread_sched_getstats() */
+static void report_sched_stats() {
+	rpthread_sched_stats_t *stats = &scheduler->stats;
+
+	fprintf(stderr, "rpthread: %lu context switches, %lu boosts, %lu run next\n",
+			stats->switches, stats->boosts, stats->run_next);
+	if (scheduler->virtual_time)
+		fprintf(stderr, "rpthread: virtual time %.1f ms, %lu preemption points\n",
+				scheduler->vclock, stats->events);
+	if (stats->rt_runs > 0)
+		fprintf(stderr, "rpthread: real-time: %lu runs, %.1f ms\n", stats->rt_runs, stats->rt_ms);
+	if (stats->edf_activations > 0) {
+		fprintf(stderr, "rpthread: edf: %lu runs, %.1f ms, %lu jobs, %lu missed (worst %.2f ms late), %lu throttled\n",
+				stats->edf_runs, stats->edf_ms, stats->edf_activations, stats->edf_misses,
+				stats->edf_max_late_ms, stats->edf_throttles);
+	}
+	for (int l=0; l < scheduler->levels; l++) {
+		fprintf(stderr, "rpthread: level %d quantum %d ms: %lu runs, %.1f ms\n",
+				l, scheduler->quantum[l], stats->level_runs[l], stats->level_ms[l]);
+	}
+}
+
+/* EDF parameters of tcb, allocated the first time it joins the EDF class */
+static edf_t* edf_of(tcb_t *tcb) {
+	if (tcb->edf == NULL)
+		tcb->edf = rpthread_calloc(1, sizeof(*(tcb->edf)));
+	return tcb->edf;
+}
+
+/* Start a job released at release. tcb must not be in a ready queue */
+static void start_job(tcb_t *tcb, double release) {
+	edf_t *edf = tcb->edf;
+	edf->release = release;
+	edf->due = release + edf->relative;
+	edf->used = 0;
+	tcb->deadline = edf->due;
+	scheduler->stats.edf_activations++;
+}
+
+/* Count a miss if tcb's current job finished after its deadline */
+static void end_job(tcb_t *tcb) {
+	double late = now_ms() - tcb->edf->due;
+	if (late > 0) {
+		scheduler->stats.edf_misses++;
+		if (late > scheduler->stats.edf_max_late_ms)
+			scheduler->stats.edf_max_late_ms = late;
+	}
+}
+
+/* Start the jobs of sleeping periodic threads whose release time has come */
+static void release_sleepers() {
+	double now = now_ms();
+	while (scheduler->edf_sleepers != NULL && scheduler->edf_sleepers->edf->release <= now) {
+		tcb_t *tcb = scheduler->edf_sleepers;
+		scheduler->edf_sleepers = tcb->next;
+		start_job(tcb, tcb->edf->release);
+		ready_thread(tcb);
+	}
+}
+
+/* 
+ * Monotonic wall clock in ms, used for mutex wait and hold times and EDF
+ * deadlines. The virtual clock in virtual time mode.
+ */
+static double now_ms() {
+	if (scheduler != NULL && scheduler->virtual_time)
+		return scheduler->vclock;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* CPU ms threads are charged by, or the virtual clock in virtual time mode */
+static double sched_clock() {
+	if (scheduler->virtual_time)
+		return scheduler->vclock;
+	return (double)clock() / CLOCKS_PER_SEC * 1000;
+}
+
+/* One preemption point passes in virtual time mode */
+static void vt_advance() {
+	if (scheduler != NULL && scheduler->virtual_time) {
+		scheduler->vclock += scheduler->vtick_ms;
+		scheduler->stats.events++;
+	}
+}
+
+/* 
+ * Next thread from a ready queue: the front, or with RPTHREAD_SEED set a
+ * pick from a seeded xorshift generator, so different interleavings of
+ * equal threads can be explored and each one replayed.
+ */
+static tcb_t* take_next(queue_t *queue) {
+	if (scheduler->rng == 0 || queue->size < 2)
+		return dequeue(queue);
+
+	scheduler->rng ^= scheduler->rng << 13;
+	scheduler->rng ^= scheduler->rng >> 7;
+	scheduler->rng ^= scheduler->rng << 17;
+
+	tcb_t *tcb = queue->head;
+	for (int n = scheduler->rng % queue->size; n > 0; n--) {
+		tcb = tcb->next;
+	}
+	return queue_remove(queue, tcb);
+}
+
+/* 
+ * Counters for a new mutex if RPTHREAD_MUTEX_PROFILE is set, labelled with
+ * the file:line rpthread_mutex_init() was called from until it is named.
+ */
+static rpthread_mutex_prof_t* new_mutex_prof(const char *file, int line) {
+	if (mutex_profile == -1) {
+		char *env = getenv("RPTHREAD_MUTEX_PROFILE");
+		mutex_profile = (env != NULL && strcmp(env, "0") != 0);
+		if (mutex_profile)
+			atexit(rpthread_mutex_report);
+	}
+	if (!mutex_profile)
+		return NULL;
+
+	rpthread_mutex_prof_t *prof = calloc(1, sizeof(*prof));
+	if (file != NULL) {
+		const char *base = strrchr(file, '/');
+		snprintf(prof->name, sizeof(prof->name), "%s:%d", (base != NULL) ? base + 1 : file, line);
+	}
+	else {
+		strcpy(prof->name, "(unknown)");  // called without the macro
+	}
+	prof->next = mutex_profs;
+	mutex_profs = prof;
+	return prof;
+}
+
+/* qsort() order for rpthread_mutex_report() */
+static int cmp_mutex_wait(const void *a, const void *b) {
+	double wa = (*(rpthread_mutex_prof_t * const *)a)->wait_ms;
+	double wb = (*(rpthread_mutex_prof_t * const *)b)->wait_ms;
+	return (wa < wb) - (wa > wb);
+}
+
+/* MLFQ level tcb is scheduled at, RR only has one. Real-time threads use level 0's quantum */
+static int sched_level(tcb_t *tcb) {
+	int rank = run_rank(tcb);
+	return (rank < 0) ? 0 : rank;
+}
+
+/* 
+ * Order threads are picked in, lower first. Real-time priorities are
+ * negative and EDF threads come before all of them.
+ */
+static int run_rank(tcb_t *tcb) {
+	if (tcb->deadline > 0)
+		return -RPTHREAD_RT_LEVELS - 1;
+
+	#ifdef MLFQ
+		return tcb->priority;
+	#else
+		return (tcb->priority < 0) ? tcb->priority : 0;
+	#endif
+}
+
+/* 
+ * Change tcb's current priority, moving it between ready queues if it is
+ * queued. What is left of its allotment carries over, capped at the new
+ * level's, so a priority change never hands out fresh CPU time.
+ */
+static void set_run_priority(tcb_t *tcb, int priority) {
+	if (tcb->priority == priority)
+		return;
+
+	bool queued = (tcb->state == READY && unqueue(tcb));
+	tcb->priority = priority;
+	int allotment = scheduler->allotment[sched_level(tcb)];
+	if (tcb->timeslice > allotment)
+		tcb->timeslice = allotment;
+	if (queued)
+		requeue(tcb);
+}
+
+/* 
+ * Recompute tcb's priority from every mutex on its pi_held list: the
+ * highest of pi_saved and the priorities lent by their waiters.
+ */
+static void pi_update(tcb_t *tcb) {
+	int priority = tcb->pi_saved;
+	for (rpthread_mutex_t *mutex = tcb->pi_held; mutex != NULL; mutex = mutex->pi_next) {
+		for (tcb_t *waiter = mutex->blocked_queue->head; waiter != NULL; waiter = waiter->next) {
+			// an EDF waiter lends the highest real-time priority
+			int lent = (waiter->deadline > 0) ? -RPTHREAD_RT_LEVELS : waiter->priority;
+			if (lent < priority)
+				priority = lent;
+		}
+	}
+	set_run_priority(tcb, priority);
+}
+
+/* Put mutex on holder's pi_held list and take on what its waiters lend */
+static void pi_lend(tcb_t *holder, rpthread_mutex_t *mutex) {
+	if (holder->pi_held == NULL)
+		holder->pi_saved = holder->priority;
+	pi_unlink(holder, mutex);  // already listed if an earlier waiter lent
+	mutex->pi_next = holder->pi_held;
+	holder->pi_held = mutex;
+	pi_update(holder);
+}
+
+/* Take mutex off tcb's pi_held list, returns false if it wasn't on it */
+static bool pi_unlink(tcb_t *tcb, rpthread_mutex_t *mutex) {
+	rpthread_mutex_t **link = (rpthread_mutex_t **)&tcb->pi_held;
+	while (*link != NULL && *link != mutex)
+		link = &(*link)->pi_next;
+	if (*link == NULL)
+		return false;
+
+	*link = mutex->pi_next;
+	mutex->pi_next = NULL;
+	return true;
+}
+
+/* 
+ * Timer length for tcb's next run: its level's quantum, but no longer than 
+ * what is left of its allotment on that level or its group's CPU share.
+ */
+static int run_timeslice(tcb_t *tcb) {
+	int slice = scheduler->quantum[sched_level(tcb)];
+	if (tcb->priority >= 0 && tcb->timeslice < slice)  // real-time threads have no allotment
+		slice = tcb->timeslice;
+
+	rpthread_group_t *group = tcb->group;
+	if (group != NULL && group->share > 0) {
+		int left = (double)group->share * GROUP_SHARE_PERIOD / 100 - group->used_ms;
+		if (left < slice)
+			slice = left;
+	}
+
+	// EDF jobs stop at their budget, and anyone stops when the next job is released
+	if (tcb->deadline > 0 && tcb->edf->budget > 0) {
+		int left = tcb->edf->budget - tcb->edf->used;
+		if (left < slice)
+			slice = left;
+	}
+	if (scheduler->edf_sleepers != NULL) {
+		int left = scheduler->edf_sleepers->edf->release - now_ms() + 1;
+		if (left < slice)
+			slice = left;
+	}
+	return (slice < 1) ? 1 : slice;
+}
+
+/* 
+ * Move every MLFQ thread back to its base level with a fresh allotment.
+ * Levels are drained top down so nobody is moved twice.
+ */
+static void boost_all() {
+	for (int l=1; l < scheduler->levels; l++) {
+		queue_t *queue = scheduler->thread_queues[l];
+		for (int n = queue->size; n > 0; n--) {
+			tcb_t *tcb = dequeue(queue);
+			if (tcb->base_priority < l && tcb->base_priority >= 0)
+				tcb->priority = tcb->base_priority;
+			enqueue(ready_queue(tcb), tcb);
+		}
+	}
+	for (uint32_t i=0; i < scheduler->t_count; i++) {
+		tcb_t *tcb = scheduler->tcb_arr[i];
+		if (tcb->state != FINISHED && tcb->priority >= 0) {
+			if (tcb->priority > tcb->base_priority && tcb->base_priority >= 0)
+				tcb->priority = tcb->base_priority;
+			tcb->timeslice = scheduler->allotment[tcb->priority];
+		}
+	}
+	scheduler->stats.boosts++;
+}
+
+/* Grow tcb_arr in steps of 32 until it can hold count threads */
+static void reserve_tcbs(uint32_t count) {
+	if (count <= scheduler->t_max)
+		return;
+
+	while (scheduler->t_max < count) {
+		scheduler->t_max += 32;
+	}
+	scheduler->tcb_arr = realloc(scheduler->tcb_arr, scheduler->t_max * sizeof(*(scheduler->tcb_arr)));
+}
+
+/* 
+ * Run TLS destructors for an exiting thread. A destructor may set new values,
+ * so repeat up to RPTHREAD_DESTRUCTOR_ITERATIONS passes like pthreads does. 
+ */
+static void run_key_destructors(tcb_t *tcb) {
+	for (int pass=0; pass < RPTHREAD_DESTRUCTOR_ITERATIONS; pass++) {
+		bool called = false;
+
+		for (int k=0; k < RPTHREAD_KEYS_MAX; k++) {
+			void *value = tcb->specific[k];
+			if (value == NULL || scheduler->key_dtors[k] == NULL)
+				continue;
+
+			tcb->specific[k] = NULL;  // clear first so a destructor can't see it twice
+			scheduler->key_dtors[k](value);
+			called = true;
+		}
+
+		if (!called)
+			break;
+	}
+}
+
+/* Set timer to time (ms) */
+void enable_timer(int time) {
+	itimer.it_interval.tv_sec = time / 1000;  // tv_usec must stay below 1s
+	itimer.it_interval.tv_usec = (time % 1000) * 1000;
+	itimer.it_value = itimer.it_interval;
+
+	if (!scheduler->virtual_time)  // rpthread_preempt_point() preempts instead
+		setitimer(ITIMER_PROF, &itimer, NULL);
+	scheduler->enabled = true;
+}
+
+/* Disable timer for thread safety. We got weird results when we used 
+ * setitimer() on a zeroed itimerval, so we just set a bool to ignore
+ * timeouts.
+ */
+void disable_timer() {
+	scheduler->enabled = false;
+}
+
+
+/* 
+ * End of rpthread_create(). The first create arms the timer for the main
+ * thread, later ones leave the caller on the slice it is already running
+ * on so armed_ms stays what the timer was actually set to.
+ */
+static void create_done() {
+	if (scheduler->armed_ms > 0) {
+		resume_timer();
+		return;
+	}
+	scheduler->armed_ms = run_timeslice(scheduler->running);
+	scheduler->running->last_run = sched_clock();
+	enable_timer(scheduler->armed_ms);
+}
+
+/* Stop ignoring timeouts without re-arming the timer, undoes disable_timer() */
+static void resume_timer() {
+	scheduler->enabled = true;
+}
+
+
+/* Signal handler for timer timeouts */
+void handle_timeout(int signum) {
+	if (scheduler->enabled) {  // ignore timeout if enabled=false
+		if (scheduler->preempt_off > 0) {  // inside rpthread_malloc() etc, run it later
+			scheduler->preempt_pending = true;
+			return;
+		}
+		preempt();
+	}
+}
+
+/* 
+ * Running thread used all of the time it was armed for. schedule() charges
+ * at least that much so a thread is demoted when its allotment runs out
+ * even if clock() lags the timer.
+ */
+static void preempt() {
+	scheduler->timer_fired = true;
+	schedule();
+}
+
+/* Runs after thread completes */
+void handle_exit() {
+	scheduler->running->state = FINISHED;
+	schedule();
+}
+
+
+/* 
+ * Simple RR scheduler. Assumes that all threads in the queue are ready,
+ * (blocked threads from rpthread_join() and rpthread_mutex_lock() are already
+ * removed from queue by scheduler). After this function returns, 
+ * scheduler->running will be the next thread to run.
+ */
+static void sched_rr() {
+	queue_t *queue = scheduler->thread_queues[0];  // only use first queue
+
+	if (sched_edf() || sched_rt())
+		return;
+	if (scheduler->running != NULL && scheduler->running->priority < 0)
+		return;  // real-time thread keeps running until it blocks or yields to an equal
+
+	if (queue->size == 0)  // no other threads avaliable (except running)
+		return;  		   // let running continue
+
+	/* With group shares, skip threads whose group used up its share as 
+	 * long as someone else can run */
+	tcb_t *next = NULL;
+	if (scheduler->share_groups != NULL) {
+		next = first_under_share(queue);
+		if (next == NULL && scheduler->running != NULL && !over_share(scheduler->running))
+			return;
+	}
+
+	enqueue(queue, scheduler->running);
+	if (next != NULL)
+		scheduler->running = queue_remove(queue, next);
+	else
+		scheduler->running = take_next(queue);  // schedule from front of queue
+}
+
+/* 
+ * EDF class, checked before every other class. Runs the ready thread with
+ * the earliest deadline unless the running EDF thread's is earlier. 
+ * Returns false if neither the running thread nor a waiting one is EDF.
+ */
+static bool sched_edf() {
+	tcb_t *running = scheduler->running;
+	bool running_edf = (running != NULL && running->deadline > 0);
+
+	if (scheduler->edf_heap->size == 0)
+		return running_edf;  // keeps the CPU over every other class
+	if (running_edf && running->deadline <= scheduler->edf_heap->nodes[0]->deadline)
+		return true;
+
+	if (running != NULL)
+		requeue(running);
+	scheduler->running = heap_pop(scheduler->edf_heap);
+	return true;
+}
+
+/* 
+ * Run the thread in the run-next slot on the left ms of its waker's
+ * timeslice, so a pair handing a lock back and forth shares one timeslice
+ * and can't starve everyone else. Once that is used up, or a higher
+ * priority thread is waiting, the woken thread queues like any other.
+ */
+static bool sched_run_next(int left) {
+	tcb_t *next = scheduler->run_next;
+	if (next == NULL)
+		return false;
+	scheduler->run_next = NULL;
+
+	if (left < 1 || outranked(next) || over_share(next)) {
+		requeue(next);
+		return false;
+	}
+
+	if (scheduler->running != NULL)
+		requeue(scheduler->running);
+	scheduler->running = next;
+	scheduler->stats.run_next++;
+	return true;
+}
+
+/* True if a ready thread or the running one would be picked before tcb */
+static bool outranked(tcb_t *tcb) {
+	int rank = run_rank(tcb);
+
+	if (scheduler->edf_heap->size > 0)
+		return true;
+	for (int r=0; r < RPTHREAD_RT_LEVELS && r - RPTHREAD_RT_LEVELS < rank; r++) {
+		if (scheduler->rt_queues[r]->size > 0)
+			return true;
+	}
+	#ifdef MLFQ
+		for (int l=0; l < rank; l++) {
+			if (scheduler->thread_queues[l]->size > 0)
+				return true;
+		}
+	#endif
+
+	tcb_t *running = scheduler->running;
+	return running != NULL && run_rank(running) < rank;
+}
+
+/* Pick scheduler->running with the compiled in scheduler */
+static void sched_next() {
+	#ifdef MLFQ
 		sched_mlfq();
 	#else
 		sched_rr();
 	#endif
+}
+
+/* 
+ * Real-time class, checked before the MLFQ/RR queues. Picks the front of
+ * the highest non empty real-time queue unless the running thread outranks
+ * it. Returns false if no real-time thread is waiting.
+ */
+static bool sched_rt() {
+	tcb_t *running = scheduler->running;
+
+	for (int r=0; r < RPTHREAD_RT_LEVELS; r++) {
+		queue_t *queue = scheduler->rt_queues[r];
+		if (queue->size == 0)
+			continue;
+
+		if (running != NULL && running->priority < r - RPTHREAD_RT_LEVELS)
+			return true;  // running thread is a higher real-time priority
+		if (running != NULL)
+			requeue(running);
+		scheduler->running = take_next(queue);
+		return true;
+	}
+	return false;
+}
+
+/* 
+ * MLFQ scheduler with scheduler->levels levels. Searches all levels starting from highest
+ * priority for a ready thread. If scheduler->running is the highest priority,
+ * it will continue execution. After this function returns, scheduler->running 
+ * will be the next thread to run.
+ */
+static void sched_mlfq() {
+	tcb_t *running = scheduler->running;
+
+	if (sched_edf() || sched_rt())
+		return;
+	if (running != NULL && running->priority < 0)
+		return;  // real-time thread keeps running until it blocks or yields to an equal
+
+	/* If scheduler->running is the highest priority out of all ready
+	 * threads, there's no need to enqueue() and dequeue() it, we can
+	 * just let it keep running. We need to search for highest priority
+	 * in the queue and compare it to scheduler->running. */
+
+	int level = 0;  // set level to first level with ready thread
+	for (; level < scheduler->levels; level++) {
+		if (scheduler->thread_queues[level]->size > 0) {
+			break;
+		}
+	}
+
+	/* With group shares, threads whose group used up its share only run
+	 * when nobody else can. */
+	tcb_t *next = NULL;
+	bool running_over = false;
+	if (scheduler->share_groups != NULL) {
+		for (int l = level; l < scheduler->levels && next == NULL; l++) {
+			next = first_under_share(scheduler->thread_queues[l]);
+			if (next != NULL)
+				level = l;
+		}
+		if (running != NULL) {
+			running_over = over_share(running);
+			if (next == NULL && !running_over)
+				return;  // everyone waiting is over share
+		}
+	}
+
+	// If running == NULL bc of blocking, we cant access running->priority
+	if (running != NULL) {
+		if (level > running->priority && !(running_over && next != NULL))  // scheduler->running is highest priority
+			return;
+		else {
+			enqueue(scheduler->thread_queues[running->priority], running);  // put back in queue
+		}
+	}
+
+	if (level == scheduler->levels)  // nothing ready, running stays NULL
+		return;
+
+	if (next != NULL)
+		scheduler->running = queue_remove(scheduler->thread_queues[level], next);
+	else
+		scheduler->running = take_next(scheduler->thread_queues[level]);
+}
+
+
+/* 
+ * Main scheduler function. Called everytime we want to switch threads or handle
+ * a finished thread. On function call, scheduler->running is the previously running
+ * thread. A call to schedule() will return when thread exectuion is handed back
+ * to the calling thread. Since this function is critical and may take a while to
+ * run, timer is disabled to make it thread safe.
+ */
+static void schedule() {
+	disable_timer();  // disable itimer
+	scheduler->preempt_pending = false;  // switching anyway
+
+	double curr_time = sched_clock();  // get time to calculate thread runtime
+
+	/* A finished thread may have called schedule() from its own stack, so
+	 * its resources are only released once we are running somewhere else. */
+	if (scheduler->reap != NULL) {
+		tcb_t *reap = scheduler->reap;
+		if (reap->arena != NULL) {  // hand arena to the next thread that needs one
+			reap->arena->next = scheduler->spare_arenas;
+			scheduler->spare_arenas = reap->arena;
+			reap->arena = NULL;
+		}
+		if (scheduler->stack_paint)
+			record_stack_usage(reap);
+		release_tcb(reap);
+		scheduler->reap = NULL;
+	}
+
+	tcb_t *old_tcb = scheduler->running;
+	bool no_save = (old_tcb->state == FINISHED);  // use set_context() instead of swap_context()
+
+	// called from rpthread_exit()
+	if (old_tcb->state == FINISHED) {
+		// add threads back from joined queue, the first one runs next
+		if (old_tcb->joined->size > 0)
+			ready_next(dequeue(old_tcb->joined));
+		while (old_tcb->joined->size > 0) {
+			ready_thread(dequeue(old_tcb->joined));
+		}
+
+		// last thread of a group wakes rpthread_group_join()
+		rpthread_group_t *group = old_tcb->group;
+		if (group != NULL && --group->live == 0) {
+			while (group->joiners->size > 0) {
+				ready_thread(dequeue(group->joiners));
+			}
+		}
+
+		scheduler->reap = old_tcb;
+		scheduler->running = NULL;
+	}
+	else if (old_tcb->state == BLOCKED) {
+		scheduler->running = NULL;  // blocked thread doesn't belong in queue
+	}
+
+
+	/* Calculate thread runtime from sched_clock() */
+	double ms_used = (old_tcb->last_run < 0) ? 0 : curr_time - old_tcb->last_run;
+	if (scheduler->timer_fired && ms_used < scheduler->armed_ms)
+		ms_used = scheduler->armed_ms;
+	scheduler->timer_fired = false;
+
+	charge_group(old_tcb, ms_used);
+	if (old_tcb->deadline > 0)
+		scheduler->stats.edf_ms += ms_used;
+	else if (old_tcb->priority < 0)
+		scheduler->stats.rt_ms += ms_used;
+	else
+		scheduler->stats.level_ms[sched_level(old_tcb)] += ms_used;
+
+	/* This section prevents gaming MLFQ. If a thread uses its whole allotment
+	on a level, we reduce its priority. This prevents a thread from calling 
+	rpthread_yield() to stay at highest priority level. Real-time threads
+	are never demoted. */
+	if (old_tcb->deadline > 0) {
+		edf_t *edf = old_tcb->edf;
+		edf->used += ms_used;
+		if (edf->budget > 0 && edf->used >= edf->budget) {  // out of budget until next release
+			old_tcb->deadline = 0;
+			scheduler->stats.edf_throttles++;
+		}
+	}
+	else if (old_tcb->priority >= 0 && old_tcb->priority < scheduler->levels-1) {
+		old_tcb->timeslice -= ms_used;
+		if (old_tcb->timeslice <= 0) {  // exhausted allotment, increase priority
+			old_tcb->priority++;
+			old_tcb->timeslice = scheduler->allotment[old_tcb->priority];
+		}
+	}
+
+	scheduler->since_boost_ms += ms_used;
+	if (scheduler->boost_ms > 0 && scheduler->since_boost_ms >= scheduler->boost_ms) {
+		boost_all();
+		scheduler->since_boost_ms = 0;
+	}
+
+	release_sleepers();
+
+	/* rpthread_yield_to() target runs next on what is left of the caller's
+	timeslice */
+	tcb_t *target = scheduler->yield_target;
+	scheduler->yield_target = NULL;
+	int left = scheduler->armed_ms - ms_used;  // of the slice old_tcb was running on
+
+	if (target != NULL && sched_yield_to(target, left)) {
+		scheduler->armed_ms = left;
+	}
+	else if (sched_run_next(left)) {
+		int slice = run_timeslice(scheduler->running);
+		scheduler->armed_ms = (slice < left) ? slice : left;
+	}
+	else {
+		sched_next();
+
+		// nothing to run but periodic EDF threads that aren't released yet
+		while (scheduler->running == NULL && scheduler->edf_sleepers != NULL) {
+			struct timespec ts;
+			double release = scheduler->edf_sleepers->edf->release;
+			if (scheduler->virtual_time) {
+				scheduler->vclock = release;
+			}
+			else {
+				ts.tv_sec = release / 1000;
+				ts.tv_nsec = (release - ts.tv_sec * 1000.0) * 1000000;
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			}
+
+			release_sleepers();
+			sched_next();
+		}
+
+		scheduler->armed_ms = run_timeslice(scheduler->running);
+	}
 
-	scheduler->running->last_run = clock();  // record start time
-	enable_timer(scheduler->running->timeslice);
+	if (scheduler->running->deadline > 0)
+		scheduler->stats.edf_runs++;
+	else if (scheduler->running->priority < 0)
+		scheduler->stats.rt_runs++;
+	else
+		scheduler->stats.level_runs[sched_level(scheduler->running)]++;
+	if (scheduler->running != old_tcb)
+		scheduler->stats.switches++;
+
+	scheduler->running->last_run = sched_clock();  // record start time
+	enable_timer(scheduler->armed_ms);
 
 	if (scheduler->running == old_tcb) {  // no context change
 		return;
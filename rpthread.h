@@ -18,6 +18,10 @@
 
 #define SS_SIZE SIGSTKSZ
 #define MLFQ_LEVELS 8
+#define RPTHREAD_RT_LEVELS 4  /* real-time priorities -RPTHREAD_RT_LEVELS (highest) to -1 */
+
+#define RPTHREAD_DESTRUCTOR_ITERATIONS 4
+#define GROUP_SHARE_PERIOD 100  /* ms of CPU time that group shares are measured over */
 
 #define READY 0
 #define BLOCKED 1
@@ -28,39 +32,310 @@
 #include <signal.h>
 #include <ucontext.h>
 #include "tcb.h"
+#include "arena.h"
+#include "reducer.h"
+
+
+/* 
+ * Contention counters of one mutex, kept when RPTHREAD_MUTEX_PROFILE=1.
+ * Outlives the mutex so destroyed mutexes still show in the report.
+ */
+typedef struct rpthread_mutex_prof_t {
+	char          name[32];     /* rpthread_mutex_setname() or file:line of init */
+	unsigned long acquires;
+	unsigned long contended;    /* acquires that had to block */
+	double        wait_ms;      /* total time spent blocked */
+	double        max_wait_ms;
+	double        hold_ms;      /* total time held */
+	double        locked_at;    /* start of current hold */
+	uint32_t      max_queue;    /* longest blocked_queue seen */
+	struct rpthread_mutex_prof_t* next;
+} rpthread_mutex_prof_t;
 
 
 typedef struct rpthread_mutex_t {
 	unsigned char  lock;
 	rpthread_t 	   tid;
 	queue_t*       blocked_queue;
+	rpthread_mutex_prof_t* prof;  /* NULL unless profiling */
+	struct rpthread_mutex_t* pi_next;  /* next mutex on the holder's pi_held list */
 } rpthread_mutex_t;
 
 
+/* 
+ * Reader-writer lock with writer preference. Readers and writers park on
+ * separate queues, all readers are woken together when a writer leaves.
+ */
+typedef struct rpthread_rwlock_t {
+	int         readers;          /* threads holding a read lock */
+	bool        writer;           /* write lock held by wtid */
+	rpthread_t  wtid;
+	int         writers_waiting;  /* parked writers, blocks new readers */
+	queue_t*    read_queue;
+	queue_t*    write_queue;
+} rpthread_rwlock_t;
+
+
+/* 
+ * Sequence lock for tiny, read-mostly data. Readers never block, they copy
+ * the data and retry if a writer ran meanwhile (seq odd or changed).
+ */
+typedef struct rpthread_seqlock_t {
+	volatile unsigned int seq;
+	rpthread_mutex_t      write_lock;
+} rpthread_seqlock_t;
+
+
+/* MLFQ tuning, see rpthread_sched_setconfig() */
+typedef struct rpthread_sched_config_t {
+	int levels;                   /* levels in use, 1 - MLFQ_LEVELS */
+	int quantum[MLFQ_LEVELS];     /* ms a thread runs before it is preempted */
+	int allotment[MLFQ_LEVELS];   /* ms a thread gets on a level before demotion */
+	int boost_ms;                 /* ms between boosts back to level 0, 0 = never */
+} rpthread_sched_config_t;
+
+
+/* scheduler counters, see rpthread_sched_getstats() */
+typedef struct rpthread_sched_stats_t {
+	double        level_ms[MLFQ_LEVELS];    /* CPU time spent running per level */
+	unsigned long level_runs[MLFQ_LEVELS];  /* times a thread was dispatched per level */
+	double        rt_ms;                    /* CPU time spent running real-time threads */
+	unsigned long rt_runs;
+	double        edf_ms;                   /* CPU time spent running EDF threads */
+	unsigned long edf_runs;
+	unsigned long edf_activations;          /* EDF jobs started */
+	unsigned long edf_misses;               /* EDF jobs finished after their deadline */
+	unsigned long edf_throttles;            /* EDF jobs that ran out of budget */
+	double        edf_max_late_ms;          /* worst deadline miss */
+	unsigned long run_next;                 /* woken threads that ran straight after their waker */
+	unsigned long events;                   /* preemption points counted in virtual time mode */
+	unsigned long switches;
+	unsigned long boosts;
+} rpthread_sched_stats_t;
+
+
+/* 
+ * Set of threads joined as a unit. With a share set, the group's threads
+ * are passed over by the scheduler once they used share% of the last 
+ * GROUP_SHARE_PERIOD ms, as long as threads outside the group are ready.
+ */
+typedef struct rpthread_group_t {
+	int         live;      /* threads in group that haven't finished */
+	queue_t*    joiners;   /* threads parked in rpthread_group_join() */
+	int         share;     /* percent of CPU, 0 = unlimited */
+	double      used_ms;   /* CPU used in current share period */
+	struct rpthread_group_t* next;  /* link in scheduler->share_groups */
+} rpthread_group_t;
+
+
+/* 
+ * Deadline parameters of an EDF thread. A job is released, must finish 
+ * within relative ms, and may use budget ms of CPU before it drops to the
+ * thread's normal class until its next release. period is 0 for one-shot
+ * jobs started with rpthread_edf_begin().
+ */
+typedef struct edf_t {
+	int     period;
+	int     relative;
+	int     budget;    /* 0 = unlimited */
+	double  release;   /* start of current job */
+	double  due;       /* deadline of current job, kept while throttled */
+	double  used;      /* CPU ms used by current job */
+} edf_t;
+
+
+/* thread parked in rpthread_future_wait_any(), one per watched future */
+typedef struct future_watch_t {
+	tcb_t*                 tcb;
+	struct future_watch_t* next;
+} future_watch_t;
+
+
+/* 
+ * Result of a thread started with rpthread_async(). Threads wait on the
+ * future itself rather than on a tid, and continuations added with
+ * rpthread_future_then() are started when it resolves.
+ */
+typedef struct rpthread_future_t {
+	bool            ready;
+	void*           value;
+	rpthread_t      tid;        /* thread computing value */
+
+	future_watch_t* watchers;   /* parked waiters */
+	struct rpthread_future_t* thens;      /* continuations to start */
+	struct rpthread_future_t* next_then;  /* link in parent's thens list */
+
+	void*         (*func)(void *);
+	void*           arg;
+} rpthread_future_t;
+
+
+/* 
+ * Worker threads that run submitted jobs and park on idle between them
+ * instead of exiting. Starts min_workers and grows to max_workers while
+ * every worker is busy, workers above min_workers exit once the queue is
+ * empty. Jobs are futures, linked through next_then while queued.
+ */
+typedef struct rpthread_pool_t {
+	rpthread_future_t* head;    /* queued jobs */
+	rpthread_future_t* tail;
+	int         workers;        /* live worker threads */
+	int         min_workers;
+	int         max_workers;
+	bool        shutdown;       /* no more submits, workers exit when queue is empty */
+	queue_t*    idle;           /* parked workers */
+	queue_t*    joiners;        /* threads in rpthread_pool_shutdown() */
+} rpthread_pool_t;
+
+
 typedef struct Scheduler {
 	queue_t*    thread_queues[MLFQ_LEVELS];
+	queue_t*    rt_queues[RPTHREAD_RT_LEVELS];  /* index 0 is the highest priority */
+	heap_t*     edf_heap;      /* ready EDF threads, earliest deadline first */
+	tcb_t*      edf_sleepers;  /* periodic EDF threads waiting for release, sorted */
 	tcb_t*      running;
 
+	/* MLFQ tuning and counters */
+	int         levels;
+	int         quantum[MLFQ_LEVELS];
+	int         allotment[MLFQ_LEVELS];
+	int         boost_ms;
+	double      since_boost_ms;
+	int         armed_ms;     /* length the timer was last set to */
+	bool        timer_fired;  /* running thread was preempted by the timer */
+	rpthread_sched_stats_t stats;
+
 	tcb_t**     tcb_arr;
-	uint8_t		t_count;
-	uint8_t		t_max;
+	uint32_t    t_count;
+	uint32_t    t_max;
+	tcb_t*      yield_target;  /* set by rpthread_yield_to() for the next schedule() */
+	tcb_t*      run_next;      /* thread woken by unlock or exit, runs after its waker */
+	tcb_t*      reap;  /* finished thread whose stack is freed on next schedule() */
 
 	ucontext_t* exit_uctx;
 
+	/* rpthread_malloc() state */
+	arena_t*    spare_arenas;     /* arenas of finished threads */
+	int         preempt_off;      /* nesting of rpthread_preempt_disable() */
+	bool        preempt_pending;  /* timeout arrived while preempt_off */
+
+	/* thread groups with a CPU share */
+	rpthread_group_t* share_groups;
+	double      share_period_ms;  /* CPU time handed out in current period */
+
+	/* thread-local storage keys, values live in tcb->specific[] */
+	bool        key_used[RPTHREAD_KEYS_MAX];
+	void        (*key_dtors[RPTHREAD_KEYS_MAX])(void *);
+
+	/* deterministic mode, see init_sched_config() */
+	bool        virtual_time;  /* no SIGPROF, time only moves at preemption points */
+	double      vclock;        /* virtual ms */
+	double      vtick_ms;      /* virtual time one preemption point takes */
+	uint64_t    rng;           /* seeded tie-breaking state, 0 = FIFO */
+
+	/* stack high-water tracking, enabled by RPTHREAD_STACK_PAINT=1 */
+	bool        stack_paint;
+	uint32_t    stack_reports;
+	size_t      stack_used_max;
+	size_t      stack_used_total;
+
 	bool enabled;
 
 } Scheduler;
 
 
 int  rpthread_create(rpthread_t *thread, pthread_attr_t *attr, void *(*function)(void *), void *arg);
+int  rpthread_create_n(rpthread_t *threads, int n, pthread_attr_t *attr,
+                       void *(*function)(void *), void *args, size_t stride);
 int  rpthread_yield();
+int  rpthread_yield_to(rpthread_t thread);
+void rpthread_preempt_point();
 void rpthread_exit(void *value_ptr);
 int  rpthread_join(rpthread_t thread, void **value_ptr);
+int  rpthread_stack_usage(rpthread_t thread, size_t *used, size_t *size);
+int  rpthread_setpriority(rpthread_t thread, int priority);
+int  rpthread_getpriority(rpthread_t thread, int *priority);
+int  rpthread_edf_begin(int deadline_ms);
+int  rpthread_edf_periodic(int period_ms, int deadline_ms, int budget_ms);
+int  rpthread_edf_wait_period();
+int  rpthread_edf_end();
 
 int rpthread_mutex_init(rpthread_mutex_t *mutex, const pthread_mutexattr_t *mutexattr);
+int rpthread_mutex_init_at(rpthread_mutex_t *mutex, const pthread_mutexattr_t *mutexattr,
+                           const char *file, int line);
 int rpthread_mutex_lock(rpthread_mutex_t *mutex);
 int rpthread_mutex_unlock(rpthread_mutex_t *mutex);
 int rpthread_mutex_destroy(rpthread_mutex_t *mutex);
+int rpthread_mutex_setname(rpthread_mutex_t *mutex, const char *name);
+void rpthread_mutex_report();
+
+int rpthread_rwlock_init(rpthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr);
+int rpthread_rwlock_rdlock(rpthread_rwlock_t *rwlock);
+int rpthread_rwlock_wrlock(rpthread_rwlock_t *rwlock);
+int rpthread_rwlock_tryrdlock(rpthread_rwlock_t *rwlock);
+int rpthread_rwlock_trywrlock(rpthread_rwlock_t *rwlock);
+int rpthread_rwlock_unlock(rpthread_rwlock_t *rwlock);
+int rpthread_rwlock_destroy(rpthread_rwlock_t *rwlock);
+
+int  rpthread_seqlock_init(rpthread_seqlock_t *seqlock);
+int  rpthread_seqlock_init_at(rpthread_seqlock_t *seqlock, const char *file, int line);
+void rpthread_seqlock_write_lock(rpthread_seqlock_t *seqlock);
+void rpthread_seqlock_write_unlock(rpthread_seqlock_t *seqlock);
+int  rpthread_seqlock_destroy(rpthread_seqlock_t *seqlock);
+
+/* init calls record where they were made, mutex profiling labels locks with it */
+#define rpthread_mutex_init(mutex, mutexattr) \
+	rpthread_mutex_init_at(mutex, mutexattr, __FILE__, __LINE__)
+#define rpthread_seqlock_init(seqlock) rpthread_seqlock_init_at(seqlock, __FILE__, __LINE__)
+
+/* Seqlock read side is inlined, it runs on every read of the protected data */
+static inline unsigned int rpthread_seqlock_read_begin(rpthread_seqlock_t *seqlock) {
+	unsigned int seq;
+	while ((seq = seqlock->seq) & 1) {  // writer was preempted mid-update
+		rpthread_yield();
+	}
+	__sync_synchronize();
+	return seq;
+}
+
+static inline bool rpthread_seqlock_read_retry(rpthread_seqlock_t *seqlock, unsigned int seq) {
+	__sync_synchronize();
+	return seqlock->seq != seq;
+}
+
+rpthread_future_t* rpthread_async(void *(*function)(void *), void *arg);
+void*              rpthread_future_get(rpthread_future_t *future);
+int                rpthread_future_wait_any(rpthread_future_t **futures, int n);
+int                rpthread_future_wait_all(rpthread_future_t **futures, int n);
+rpthread_future_t* rpthread_future_then(rpthread_future_t *future, void *(*function)(void *));
+void               rpthread_future_destroy(rpthread_future_t *future);
+
+int                rpthread_pool_init(rpthread_pool_t *pool, int min_workers, int max_workers);
+rpthread_future_t* rpthread_pool_submit(rpthread_pool_t *pool, void *(*function)(void *), void *arg);
+int                rpthread_pool_shutdown(rpthread_pool_t *pool);
+
+int rpthread_sched_getconfig(rpthread_sched_config_t *config);
+int rpthread_sched_setconfig(const rpthread_sched_config_t *config);
+int rpthread_sched_getstats(rpthread_sched_stats_t *stats);
+
+int rpthread_group_init(rpthread_group_t *group, int share);
+int rpthread_group_create(rpthread_group_t *group, rpthread_t *thread, pthread_attr_t *attr,
+                          void *(*function)(void *), void *arg);
+int rpthread_group_create_n(rpthread_group_t *group, rpthread_t *threads, int n, pthread_attr_t *attr,
+                            void *(*function)(void *), void *args, size_t stride);
+int rpthread_group_join(rpthread_group_t *group);
+int rpthread_group_destroy(rpthread_group_t *group);
+
+void* rpthread_malloc(size_t size);
+void* rpthread_calloc(size_t count, size_t size);
+void  rpthread_free(void *ptr);
+void  rpthread_preempt_disable();
+void  rpthread_preempt_enable();
+
+int   rpthread_key_create(rpthread_key_t *key, void (*destructor)(void *));
+int   rpthread_key_delete(rpthread_key_t key);
+void* rpthread_getspecific(rpthread_key_t key);
+int   rpthread_setspecific(rpthread_key_t key, const void *value);
 
 
 #ifdef USE_RTHREAD
@@ -73,6 +348,19 @@ int rpthread_mutex_destroy(rpthread_mutex_t *mutex);
 #define pthread_mutex_lock rpthread_mutex_lock
 #define pthread_mutex_unlock rpthread_mutex_unlock
 #define pthread_mutex_destroy rpthread_mutex_destroy
+#define pthread_rwlock_t rpthread_rwlock_t
+#define pthread_rwlock_init rpthread_rwlock_init
+#define pthread_rwlock_rdlock rpthread_rwlock_rdlock
+#define pthread_rwlock_wrlock rpthread_rwlock_wrlock
+#define pthread_rwlock_tryrdlock rpthread_rwlock_tryrdlock
+#define pthread_rwlock_trywrlock rpthread_rwlock_trywrlock
+#define pthread_rwlock_unlock rpthread_rwlock_unlock
+#define pthread_rwlock_destroy rpthread_rwlock_destroy
+#define pthread_key_t rpthread_key_t
+#define pthread_key_create rpthread_key_create
+#define pthread_key_delete rpthread_key_delete
+#define pthread_getspecific rpthread_getspecific
+#define pthread_setspecific rpthread_setspecific
 #endif
 
 #endif
@@ -2,12 +2,18 @@
 // List all group member's name: Sunny Chen, Michael Zhao
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "tcb.h"
 #include "rpthread.h"
 
 
+static size_t page_size();
+
+
 queue_t* new_queue() {
-	queue_t *queue = malloc(sizeof(*queue));
+	queue_t *queue = rpthread_malloc(sizeof(*queue));
 	queue->head = NULL;
 	queue->tail = NULL;
 	queue->size = 0;
@@ -45,44 +51,297 @@ tcb_t* dequeue(queue_t *queue) {
 	return node;
 }
 
-tcb_t* new_tcb(rpthread_t tid, void *(*func_ptr)(void *), void *args) {
-	tcb_t *tcb = malloc(sizeof(*tcb));
+/* Unlink node from anywhere in queue, returns NULL if it isn't there */
+tcb_t* queue_remove(queue_t *queue, tcb_t *node) {
+	tcb_t *prev = NULL;
+	tcb_t *curr = queue->head;
+	while (curr != NULL && curr != node) {
+		prev = curr;
+		curr = curr->next;
+	}
+	if (curr == NULL)
+		return NULL;
+
+	if (prev == NULL)
+		queue->head = curr->next;
+	else
+		prev->next = curr->next;
+
+	if (queue->tail == curr)
+		queue->tail = prev;
+	queue->size--;
+
+	curr->next = NULL;
+	return curr;
+}
 
+/* heap functions */
+
+static void heap_place(heap_t *heap, uint32_t i, tcb_t *node) {
+	heap->nodes[i] = node;
+	node->heap_index = i;
+}
+
+/* Move node at i up or down until the heap order holds again */
+static void heap_fix(heap_t *heap, uint32_t i) {
+	tcb_t *node = heap->nodes[i];
+
+	while (i > 0 && heap->nodes[(i - 1) / 2]->deadline > node->deadline) {
+		heap_place(heap, i, heap->nodes[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	for (;;) {
+		uint32_t child = 2 * i + 1;
+		if (child >= heap->size)
+			break;
+		if (child + 1 < heap->size && heap->nodes[child + 1]->deadline < heap->nodes[child]->deadline)
+			child++;
+		if (heap->nodes[child]->deadline >= node->deadline)
+			break;
+		heap_place(heap, i, heap->nodes[child]);
+		i = child;
+	}
+	heap_place(heap, i, node);
+}
+
+heap_t* new_heap() {
+	heap_t *heap = rpthread_malloc(sizeof(*heap));
+	heap->max = 32;
+	heap->size = 0;
+	heap->nodes = rpthread_malloc(heap->max * sizeof(*(heap->nodes)));
+	return heap;
+}
+
+/* Add node ordered by node->deadline */
+void heap_push(heap_t *heap, tcb_t *node) {
+	if (heap->size == heap->max) {
+		tcb_t **nodes = rpthread_malloc(2 * heap->max * sizeof(*nodes));
+		memcpy(nodes, heap->nodes, heap->size * sizeof(*nodes));
+		rpthread_free(heap->nodes);
+		heap->nodes = nodes;
+		heap->max *= 2;
+	}
+	heap_place(heap, heap->size++, node);
+	heap_fix(heap, node->heap_index);
+}
+
+/* Remove and return node with the earliest deadline */
+tcb_t* heap_pop(heap_t *heap) {
+	if (heap->size == 0)
+		return NULL;
+	return heap_remove(heap, heap->nodes[0]);
+}
+
+/* Unlink node from heap, returns NULL if it isn't there */
+tcb_t* heap_remove(heap_t *heap, tcb_t *node) {
+	uint32_t i = node->heap_index;
+	if (i >= heap->size || heap->nodes[i] != node)
+		return NULL;
+
+	tcb_t *last = heap->nodes[--heap->size];
+	if (last != node) {
+		heap_place(heap, i, last);
+		heap_fix(heap, i);
+	}
+	return node;
+}
+
+/* fill in tcb fields, uctx and joined queue are supplied by caller */
+static void init_tcb(tcb_t *tcb, rpthread_t tid, void *(*func_ptr)(void *), void *args) {
 	tcb->tid = tid;
 	tcb->priority = 0;
+	tcb->base_priority = 0;
+	tcb->pi_saved = 0;
+	tcb->pi_held = NULL;
 	tcb->state = READY;
-	tcb->uctx = malloc(sizeof(*(tcb->uctx)));
 
-	tcb->last_run = 0;
+	tcb->last_run = -1;
 	tcb->timeslice = TIMESLICE;
 
 	tcb->func_ptr = func_ptr;
 	tcb->args = args;
 	tcb->retval = NULL;
+	memset(tcb->specific, 0, sizeof(tcb->specific));
 
-	tcb->joined = new_queue();
+	tcb->stack_size = 0;
+	tcb->stack_used = 0;
+	tcb->arena = NULL;
+	tcb->group = NULL;
+
+	tcb->deadline = 0;
+	tcb->heap_index = 0;
+	tcb->edf = NULL;
+
+	tcb->batch = NULL;
 	tcb->next = NULL;
+}
+
+tcb_t* new_tcb(rpthread_t tid, void *(*func_ptr)(void *), void *args) {
+	tcb_t *tcb = rpthread_malloc(sizeof(*tcb));
+	init_tcb(tcb, tid, func_ptr, args);
+
+	tcb->uctx = rpthread_malloc(sizeof(*(tcb->uctx)));
+	tcb->joined = new_queue();
 
 	return tcb;
 }
 
-/* setup ucontext for thread and allocate stack */
-void setup_tcb_context(ucontext_t *uc, ucontext_t *uc_link, tcb_t *tcb) {
+/* 
+ * Allocate n threads with tids first_tid..first_tid+n-1 using one allocation
+ * each for tcbs, contexts, joined queues and stacks. Thread i gets
+ * args + i*stride as its argument. Contexts are ready to run. Returns NULL
+ * if the stacks can't be mapped.
+ */
+tcb_batch_t* new_tcb_batch(rpthread_t first_tid, int n, void *(*func_ptr)(void *),
+						   void *args, size_t stride, ucontext_t *uc_link,
+						   size_t stack_size, bool paint) {
+	stack_size = round_stack_size(stack_size);
+	char *stacks = alloc_stacks(n, stack_size, paint);
+	if (stacks == NULL)
+		return NULL;
+
+	tcb_batch_t *batch = rpthread_malloc(sizeof(*batch));
+	batch->live = n;
+	batch->tcbs = rpthread_malloc(n * sizeof(*(batch->tcbs)));
+	batch->uctxs = rpthread_malloc(n * sizeof(*(batch->uctxs)));
+	batch->queues = rpthread_calloc(n, sizeof(*(batch->queues)));
+
+	for (int i=0; i < n; i++) {
+		tcb_t *tcb = &batch->tcbs[i];
+		void *arg = (args == NULL) ? NULL : (char *)args + i * stride;
+
+		init_tcb(tcb, first_tid + i, func_ptr, arg);
+		tcb->uctx = &batch->uctxs[i];
+		tcb->joined = &batch->queues[i];
+		tcb->batch = batch;
+
+		char *stack = stacks + (size_t)i * (stack_size + page_size());
+		make_tcb_context(tcb->uctx, uc_link, tcb, stack, stack_size);
+	}
+	return batch;
+}
+
+/* setup ucontext for thread and allocate a stack of stack_size bytes */
+int setup_tcb_context(ucontext_t *uc, ucontext_t *uc_link, tcb_t *tcb,
+					  size_t stack_size, bool paint) {
+	stack_size = round_stack_size(stack_size);
+	void *stack = alloc_stacks(1, stack_size, paint);
+	if (stack == NULL)
+		return -1;
+
+	make_tcb_context(uc, uc_link, tcb, stack, stack_size);
+	return 0;
+}
+
+/* setup ucontext for thread on an already allocated stack */
+void make_tcb_context(ucontext_t *uc, ucontext_t *uc_link, tcb_t *tcb, void *stack, size_t size) {
 	getcontext(uc);
-	uc->uc_stack.ss_sp = malloc(SS_SIZE);
-	uc->uc_stack.ss_size = SS_SIZE;
+	uc->uc_stack.ss_sp = stack;
+	uc->uc_stack.ss_size = size;
 	uc->uc_link = uc_link;
+	tcb->stack_size = size;
 
 	/* all threads are run inside thread_wrapper() so we can store the retval */
 	makecontext(uc, (void (*)())thread_wrapper, 1, tcb);
 }
 
+/* 
+ * Free a finished thread's stack, context and joined queue. The tcb itself is
+ * kept so rpthread_join() can still read retval. Batch threads release their
+ * share of the batch, which is freed once every thread in it has finished.
+ */
+void release_tcb(tcb_t *tcb) {
+	tcb_batch_t *batch = tcb->batch;
+	free_stack(tcb->uctx->uc_stack.ss_sp, tcb->uctx->uc_stack.ss_size);
+	rpthread_free(tcb->edf);
+	tcb->edf = NULL;
+
+	if (batch == NULL) {
+		rpthread_free(tcb->joined);
+		rpthread_free(tcb->uctx);
+	}
+	else if (--batch->live == 0) {
+		rpthread_free(batch->queues);
+		rpthread_free(batch->uctxs);
+	}
+	tcb->joined = NULL;
+	tcb->uctx = NULL;
+}
+
 void free_tcb(tcb_t *tcb) {
-	free(tcb->uctx->uc_stack.ss_sp);
-	free(tcb->uctx);
-	free(tcb);
+	free_stack(tcb->uctx->uc_stack.ss_sp, tcb->uctx->uc_stack.ss_size);
+	rpthread_free(tcb->uctx);
+	rpthread_free(tcb);
+}
+
+
+/* stack functions */
+
+/* Every stack gets one PROT_NONE guard page of this size below it */
+static size_t page_size() {
+	static size_t page = 0;
+	if (page == 0)
+		page = sysconf(_SC_PAGESIZE);
+	return page;
+}
+
+/* Round requested stack size up to whole pages, at least STACK_MIN */
+size_t round_stack_size(size_t size) {
+	size_t page = page_size();
+	if (size < STACK_MIN)
+		size = STACK_MIN;
+	return (size + page - 1) & ~(page - 1);
+}
+
+/* 
+ * Map n stacks of size bytes (already page rounded), each with a PROT_NONE
+ * guard page below it so an overflow faults instead of corrupting the heap.
+ * Stack i starts at the returned pointer + i*(size + page). Mapped 
+ * with MAP_NORESERVE so only touched pages are committed. If paint is set
+ * every stack is filled with STACK_PAINT_BYTE for stack_high_water().
+ */
+void* alloc_stacks(int n, size_t size, bool paint) {
+	size_t guard = page_size();
+	size_t slot = size + guard;
+	char *map = mmap(NULL, (size_t)n * slot, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	for (int i=0; i < n; i++) {
+		char *base = map + (size_t)i * slot;
+		mprotect(base, guard, PROT_NONE);
+		if (paint)
+			memset(base + guard, STACK_PAINT_BYTE, size);
+	}
+	return map + guard;
+}
+
+/* Unmap a stack and its guard page. Works on single stacks of a batch too */
+void free_stack(void *stack, size_t size) {
+	munmap((char *)stack - page_size(), size + page_size());
+}
+
+/* 
+ * Bytes of a painted stack that have been written to. Stacks grow down, so
+ * the first byte that lost its paint from the bottom is the deepest point.
+ */
+size_t stack_high_water(void *stack, size_t size) {
+	const uint64_t paint = 0x0101010101010101ULL * STACK_PAINT_BYTE;
+	const uint64_t *word = stack;
+	size_t words = size / sizeof(*word);
+
+	size_t i = 0;
+	while (i < words && word[i] == paint) {
+		i++;
+	}
+	return size - i * sizeof(*word);
 }
 
 void thread_wrapper(tcb_t *tcb) {
 	tcb->retval = tcb->func_ptr(tcb->args);  // store retval in tcb
+
+	/* Finish through rpthread_exit() so TLS destructors run on this thread's
+	 * own stack rather than the shared exit context. */
+	rpthread_exit(tcb->retval);
 }
@@ -6,9 +6,17 @@
 
 #include <ucontext.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <time.h>
 
-typedef uint8_t rpthread_t;
+typedef uint32_t rpthread_t;
+typedef unsigned int rpthread_key_t;  /* index into tcb->specific[] */
+
+#define RPTHREAD_KEYS_MAX 64  /* thread-local storage slots per tcb */
+
+#define STACK_MIN        16384  /* smallest stack rpthread_create() hands out */
+#define STACK_PAINT_BYTE 0xA5   /* fill pattern for stack high-water tracking */
 
 /* queue for tcb nodes */
 typedef struct queue_t {
@@ -17,17 +25,29 @@ typedef struct queue_t {
 	int size;
 } queue_t;
 
+/* min-heap of tcb nodes ordered by tcb->deadline */
+typedef struct heap_t {
+	struct tcb_t **nodes;
+	uint32_t size;
+	uint32_t max;
+} heap_t;
+
 
 /* tcb struct, contains all info about a thread */
 typedef struct tcb_t {
         /* thread info */
         rpthread_t  tid;
-        uint8_t     priority;  /* (high prio) 0 - 7 (low prio) */
+        int8_t      priority;  /* (high prio) -RPTHREAD_RT_LEVELS - -1 real-time, 0 - 7 MLFQ (low prio) */
+        int8_t      base_priority;  /* set by rpthread_setpriority(), boosts return here */
+        int8_t      pi_saved;  /* priority before a mutex waiter lent it a higher one */
+        void*       pi_held;   /* held mutexes whose waiters lend it priority, linked by pi_next */
         uint8_t     state;     /* states defined in rpthread.h */
         ucontext_t  *uctx;
+        size_t      stack_size;
+        size_t      stack_used;  /* high-water mark, set at exit when painting */
 
         /* accounting to prevent gaming */
-        clock_t  last_run;  
+        double   last_run;  /* ms on the scheduler clock when last dispatched, -1 never */
         int      timeslice;
 
         /* execution info */
@@ -35,21 +55,60 @@ typedef struct tcb_t {
         void*    args;
         void*    retval;
 
+        struct arena_t *arena;  /* rpthread_malloc() arena, created on first use */
+        void*    specific[RPTHREAD_KEYS_MAX];  /* thread-local values, indexed by rpthread_key_t */
+
+        struct rpthread_group_t *group;  /* NULL unless made by rpthread_group_create() */
         queue_t* joined; /* threads awaiting */
+        struct tcb_batch_t *batch;  /* shared allocation, NULL if created alone */
+        /* EDF class, NULL edf unless the thread used rpthread_edf_begin/periodic() */
+        double   deadline;    /* absolute ms while scheduled by EDF, 0 otherwise */
+        uint32_t heap_index;  /* position in heap_t while in it */
+        struct edf_t *edf;
+
         struct tcb_t *next;  /* tcbs are stored as LL */
 } tcb_t;
 
 
+/* threads made by rpthread_create_n() share one allocation per resource */
+typedef struct tcb_batch_t {
+        int         live;    /* threads in batch that haven't been released */
+        tcb_t      *tcbs;    /* kept after release for rpthread_join() */
+        ucontext_t *uctxs;
+        queue_t    *queues;
+} tcb_batch_t;
+
+
 /* queue functions */
 queue_t*  new_queue();
 void      enqueue(queue_t *queue, tcb_t *tcb);
 tcb_t*    dequeue(queue_t *queue);
+tcb_t*    queue_remove(queue_t *queue, tcb_t *node);
+
+/* heap functions */
+heap_t*   new_heap();
+void      heap_push(heap_t *heap, tcb_t *node);
+tcb_t*    heap_pop(heap_t *heap);
+tcb_t*    heap_remove(heap_t *heap, tcb_t *node);
 
 
 /* tcb functions */
 tcb_t*  new_tcb(rpthread_t tid, void *(*func_ptr)(void *), void *args);
-void    setup_tcb_context(ucontext_t *uc, ucontext_t *uc_link, tcb_t *tcb);
+tcb_batch_t* new_tcb_batch(rpthread_t first_tid, int n, void *(*func_ptr)(void *),
+                           void *args, size_t stride, ucontext_t *uc_link,
+                           size_t stack_size, bool paint);
+int     setup_tcb_context(ucontext_t *uc, ucontext_t *uc_link, tcb_t *tcb,
+                          size_t stack_size, bool paint);
+void    make_tcb_context(ucontext_t *uc, ucontext_t *uc_link, tcb_t *tcb, void *stack, size_t size);
+void    release_tcb(tcb_t *tcb);
 void    free_tcb(tcb_t *tcb);
 void    thread_wrapper(tcb_t *tcb);
 
+
+/* stack functions */
+size_t  round_stack_size(size_t size);
+void*   alloc_stacks(int n, size_t size, bool paint);
+void    free_stack(void *stack, size_t size);
+size_t  stack_high_water(void *stack, size_t size);
+
 #endif
\ No newline at end of file